@@ -478,13 +478,14 @@ public class FacilityBookingGUI extends JFrame {
     private DatagramPacket constructMonitorMessage(String facilityName, int duration) {
         byte[] nameBytes = facilityName.getBytes(StandardCharsets.UTF_8);
 
-        ByteBuffer buffer = ByteBuffer.allocate(1 + 4 + 1 + 4 + nameBytes.length + 4);
+        ByteBuffer buffer = ByteBuffer.allocate(1 + 4 + 1 + 4 + nameBytes.length + 4 + 1);
         buffer.put((byte) 1); // request
         buffer.putInt(request_id++);
         buffer.put((byte) 4); // choice 4 (monitor)
         buffer.putInt(nameBytes.length);
         buffer.put(nameBytes);
         buffer.putInt(duration);
+        buffer.put((byte) 1); // per-event text callbacks
 
         byte[] message = buffer.array();
         return new DatagramPacket(message, message.length, serverAddress, SERVER_PORT);
@@ -225,13 +225,14 @@ public class Main {
             byte choice_byte = 4; // Option 4 = monitor facility
 
             // Prepare buffer with monitoring data
-            ByteBuffer buffer = ByteBuffer.allocate(1 + 4 + 1 + 4 + byteName.length + 4);
+            ByteBuffer buffer = ByteBuffer.allocate(1 + 4 + 1 + 4 + byteName.length + 4 + 1);
             buffer.put(response_or_request);
             buffer.putInt(request_id);
             buffer.put((byte) choice);
             buffer.putInt(byteName.length);
             buffer.put(byteName);
             buffer.putInt(duration); // Duration in minutes
+            buffer.put((byte) 1); // Per-event text callbacks, which listenForMessages prints as they arrive
 
             byte[] message = buffer.array();
             return new DatagramPacket(message, message.length, serverAddress, serverPort);
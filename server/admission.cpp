@@ -0,0 +1,151 @@
+#ifndef ADMISSION_CPP
+#define ADMISSION_CPP
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <arpa/inet.h>
+
+// Reply status telling the client to back off; the payload is the retry delay in milliseconds
+const uint8_t BUSY_ERROR_CODE = 255;
+
+// Most datagrams read off the socket before the queues are served
+const size_t ADMISSION_BATCH_SIZE = 64;
+
+// Per-client token bucket: sustained requests per second and burst size
+const double CLIENT_RATE_PER_SECOND = 20.0;
+const double CLIENT_BURST = 40.0;
+
+// Database-backed requests allowed in flight at once
+const int DATABASE_BUDGET = 8;
+
+// Buckets untouched for this long are dropped
+const std::chrono::seconds CLIENT_IDLE_TIMEOUT(60);
+
+// Served in this order. Cached replies and in-memory reads are cheap and
+// must not wait behind writes that go to the database.
+enum RequestPriority {
+    priorityCached = 0,
+    priorityRead = 1,
+    priorityWrite = 2,
+    priorityCount = 3
+};
+
+// Token cost and longest queueing delay for each priority class
+const double PRIORITY_COST[priorityCount] = {0.25, 1.0, 2.0};
+const std::chrono::milliseconds PRIORITY_MAX_DELAY[priorityCount] = {
+    std::chrono::milliseconds(1000),
+    std::chrono::milliseconds(250),
+    std::chrono::milliseconds(500)
+};
+
+struct Datagram {
+    sockaddr_in clientAddress;
+    std::string clientKey;
+    std::vector<unsigned char> bytes;
+    std::chrono::steady_clock::time_point arrival;
+    RequestPriority priority;
+};
+
+struct TokenBucket {
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+};
+
+class AdmissionController {
+    public:
+        std::unordered_map<std::string, TokenBucket> buckets;
+        std::deque<Datagram> queues[priorityCount];
+        std::atomic<int> databaseInFlight{0};
+        std::chrono::steady_clock::time_point lastSweep = std::chrono::steady_clock::now();
+
+        static RequestPriority classify(unsigned char choice, bool cached) {
+            if (cached) {
+                return priorityCached;
+            }
+            switch (choice) {
+            case 1:
+            case 4: // Monitor subscriptions only register the client
+            case 5:
+            case 7:
+            case 9:
+                return priorityRead;
+            default:
+                return priorityWrite;
+            }
+        }
+
+        // Takes the request's cost from the client's bucket. On refusal
+        // retryAfterMs is how long until the bucket can pay for it.
+        bool allow(const std::string& clientKey, RequestPriority priority, std::chrono::steady_clock::time_point now, uint32_t& retryAfterMs) {
+            auto [it, inserted] = buckets.try_emplace(clientKey, TokenBucket{CLIENT_BURST, now});
+            TokenBucket& bucket = it->second;
+            double elapsed = std::chrono::duration<double>(now - bucket.lastRefill).count();
+            bucket.tokens = std::min(CLIENT_BURST, bucket.tokens + elapsed * CLIENT_RATE_PER_SECOND);
+            bucket.lastRefill = now;
+            double cost = PRIORITY_COST[priority];
+            if (bucket.tokens >= cost) {
+                bucket.tokens -= cost;
+                return true;
+            }
+            retryAfterMs = (uint32_t)std::ceil((cost - bucket.tokens) / CLIENT_RATE_PER_SECOND * 1000.0);
+            return false;
+        }
+
+        void enqueue(Datagram datagram) {
+            queues[datagram.priority].push_back(std::move(datagram));
+        }
+
+        bool hasPending() const {
+            for (int i = 0; i < priorityCount; i++) {
+                if (!queues[i].empty()) return true;
+            }
+            return false;
+        }
+
+        // Something queued could be served right now, i.e. not only writes waiting for a ticket
+        // or held while writesOpen is false
+        bool hasServable(bool writesOpen = true) const {
+            return !queues[priorityCached].empty() || !queues[priorityRead].empty() ||
+                   (writesOpen && !queues[priorityWrite].empty() && databaseInFlight.load() < DATABASE_BUDGET);
+        }
+
+        bool tryAcquireDatabase() {
+            int current = databaseInFlight.load();
+            while (current < DATABASE_BUDGET) {
+                if (databaseInFlight.compare_exchange_weak(current, current + 1)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void releaseDatabase() {
+            databaseInFlight--;
+        }
+
+        bool expired(const Datagram& datagram, std::chrono::steady_clock::time_point now) const {
+            return now - datagram.arrival > PRIORITY_MAX_DELAY[datagram.priority];
+        }
+
+        void sweep(std::chrono::steady_clock::time_point now) {
+            if (now - lastSweep < CLIENT_IDLE_TIMEOUT) {
+                return;
+            }
+            lastSweep = now;
+            for (auto it = buckets.begin(); it != buckets.end();) {
+                if (now - it->second.lastRefill > CLIENT_IDLE_TIMEOUT) {
+                    it = buckets.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+};
+
+#endif
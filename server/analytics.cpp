@@ -0,0 +1,74 @@
+#ifndef ANALYTICS_CPP
+#define ANALYTICS_CPP
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "bookingstore.cpp"
+
+const uint MINUTES_PER_WEEK = 7 * MINUTES_PER_DAY;
+
+// Busiest-slot rankings are by hour of the week
+const uint SLOTS_PER_WEEK = 7 * 24;
+
+// Minute-by-minute occupancy of one facility over the week. coverage counts
+// the booked bookings over each minute; occupiedBefore[m] is how many of the
+// minutes before m are covered at all, so any range is one subtraction.
+// Booking changes only touch coverage and remember the earliest minute
+// whose prefix is stale; the prefix is brought up to date on the next query.
+struct OccupancyData {
+    uint16_t coverage[MINUTES_PER_WEEK];
+    uint16_t occupiedBefore[MINUTES_PER_WEEK + 1];
+    uint staleFrom = MINUTES_PER_WEEK;
+};
+
+class OccupancyIndex {
+    public:
+        // Allocated on the first booking so idle facilities cost nothing
+        std::unique_ptr<OccupancyData> data;
+
+        void add(WeekMinute start, WeekMinute end) {
+            change(start, end, 1);
+        }
+
+        void remove(WeekMinute start, WeekMinute end) {
+            change(start, end, -1);
+        }
+
+        // Covered minutes in [from, to)
+        uint occupied(uint from, uint to) {
+            if (data == nullptr || from >= to) {
+                return 0;
+            }
+            refresh();
+            to = std::min(to, MINUTES_PER_WEEK);
+            from = std::min(from, to);
+            return data->occupiedBefore[to] - data->occupiedBefore[from];
+        }
+
+        void change(WeekMinute start, WeekMinute end, int delta) {
+            uint last = std::min<uint>(end, MINUTES_PER_WEEK);
+            if (start >= last) {
+                return;
+            }
+            if (data == nullptr) {
+                data = std::make_unique<OccupancyData>();
+                memset(data->coverage, 0, sizeof(data->coverage));
+                memset(data->occupiedBefore, 0, sizeof(data->occupiedBefore));
+            }
+            for (uint minute = start; minute < last; minute++) {
+                data->coverage[minute] = (uint16_t)(data->coverage[minute] + delta);
+            }
+            data->staleFrom = std::min<uint>(data->staleFrom, start);
+        }
+
+        void refresh() {
+            for (uint minute = data->staleFrom; minute < MINUTES_PER_WEEK; minute++) {
+                data->occupiedBefore[minute + 1] = data->occupiedBefore[minute] + (data->coverage[minute] > 0 ? 1 : 0);
+            }
+            data->staleFrom = MINUTES_PER_WEEK;
+        }
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef ASYNCDB_CPP
+#define ASYNCDB_CPP
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <libpq-fe.h>
+
+// Called with each query's result, or with nullptr if the connection failed
+// before the result arrived. The result is freed after the callback returns.
+typedef std::function<void(PGresult*)> QueryCallback;
+
+// Called once every query before a sync point has been answered; ok is false
+// if any of them failed, in which case the whole group was rolled back.
+typedef std::function<void(bool)> SyncCallback;
+
+// Sent in place of a sync's missing statements: the error makes the server
+// roll back the statements of the group that did reach it
+const char* ABORT_GROUP_SQL = "DO $$ BEGIN RAISE EXCEPTION 'statement group abandoned'; END $$";
+
+// Least time between two attempts to reconnect
+const std::chrono::seconds RECONNECT_INTERVAL(1);
+
+struct PendingQuery {
+    bool isSync;
+    QueryCallback onResult;
+    SyncCallback onSync;
+};
+
+// A single libpq connection in non-blocking pipeline mode. Queries are sent
+// without waiting for earlier ones to finish; the event loop polls socket()
+// and calls onReadable()/onWritable() to drive it. Queries between two sync
+// points run as one implicit transaction.
+class AsyncDatabase {
+    public:
+        PGconn* conn = nullptr;
+        std::string connectionString;
+        std::deque<PendingQuery> awaiting;
+        bool currentDelivered = false;
+        bool groupFailed = false;
+        // A query of the group being built could not be sent
+        bool sendFailed = false;
+        // Queries of the group being built that reached the connection
+        size_t groupSent = 0;
+        std::chrono::steady_clock::time_point lastConnectAttempt;
+        // Server process of the current connection. Notifications it raised
+        // describe this server's own writes; read by the notification thread.
+        std::atomic<int> backendPid{0};
+
+        bool connect(const std::string& connectionString) {
+            this->connectionString = connectionString;
+            lastConnectAttempt = std::chrono::steady_clock::now();
+            conn = PQconnectdb(connectionString.c_str());
+            if (PQstatus(conn) != CONNECTION_OK) {
+                std::cerr << "Failed to connect to database: " << PQerrorMessage(conn) << std::endl;
+                return false;
+            }
+            if (PQsetnonblocking(conn, 1) != 0 || PQenterPipelineMode(conn) != 1) {
+                std::cerr << "Failed to enter pipeline mode: " << PQerrorMessage(conn) << std::endl;
+                return false;
+            }
+            backendPid = PQbackendPID(conn);
+            std::cout << "Connected to database in pipeline mode" << std::endl;
+            return true;
+        }
+
+        bool connected() const {
+            return conn != nullptr && PQstatus(conn) == CONNECTION_OK && PQpipelineStatus(conn) != PQ_PIPELINE_OFF;
+        }
+
+        int socket() const {
+            return connected() ? PQsocket(conn) : -1;
+        }
+
+        size_t inFlight() const {
+            return awaiting.size();
+        }
+
+        // Once a query of a group has failed the rest of the group is not sent.
+        // A group whose connection was lost part way is not continued on a new one.
+        void send(const std::string& sql, const std::vector<std::string>& params, QueryCallback onResult) {
+            if (sendFailed || (!connected() && (groupSent > 0 || !reconnect()))) {
+                sendFailed = true;
+                onResult(nullptr);
+                return;
+            }
+            std::vector<const char*> values;
+            for (const std::string& param : params) {
+                values.push_back(param.c_str());
+            }
+            if (PQsendQueryParams(conn, sql.c_str(), (int)values.size(), nullptr, values.data(), nullptr, nullptr, 0) != 1) {
+                std::cerr << "Failed to send query: " << PQerrorMessage(conn) << std::endl;
+                sendFailed = true;
+                onResult(nullptr);
+                return;
+            }
+            awaiting.push_back(PendingQuery{false, onResult, nullptr});
+            groupSent++;
+        }
+
+        // Marks the end of a group of queries and pushes them to the server
+        void sync(SyncCallback onSync) {
+            if (sendFailed) {
+                sendFailed = false;
+                SyncCallback complete = onSync;
+                onSync = [complete](bool) { complete(false); };
+                if (groupSent > 0 && connected()) {
+                    if (PQsendQueryParams(conn, ABORT_GROUP_SQL, 0, nullptr, nullptr, nullptr, nullptr, 0) == 1) {
+                        awaiting.push_back(PendingQuery{false, nullptr, nullptr});
+                    } else {
+                        // Without a sync the server never commits the group
+                        std::cerr << "Failed to abort query group: " << PQerrorMessage(conn) << std::endl;
+                        PQfinish(conn);
+                        conn = nullptr;
+                    }
+                }
+            }
+            groupSent = 0;
+            if (!connected() || PQpipelineSync(conn) != 1) {
+                std::cerr << "Failed to sync pipeline: " << PQerrorMessage(conn) << std::endl;
+                failAll();
+                onSync(false);
+                return;
+            }
+            awaiting.push_back(PendingQuery{true, nullptr, onSync});
+            onWritable();
+        }
+
+        // Runs one statement as its own transaction. onDone gets the first
+        // column of the first returned row (empty if none) once it has committed.
+        void execute(const std::string& sql, const std::vector<std::string>& params, std::function<void(bool, const std::string&)> onDone) {
+            auto value = std::make_shared<std::string>();
+            send(sql, params, [value](PGresult* res) {
+                if (res != nullptr && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0) {
+                    *value = PQgetvalue(res, 0, 0);
+                }
+            });
+            sync([value, onDone](bool ok) {
+                onDone(ok, *value);
+            });
+        }
+
+        bool wantsWrite() const {
+            return connected() && PQisnonblocking(conn) && PQflush(conn) == 1;
+        }
+
+        void onWritable() {
+            if (connected() && PQflush(conn) < 0) {
+                std::cerr << "Failed to flush pipeline: " << PQerrorMessage(conn) << std::endl;
+                failAll();
+            }
+        }
+
+        void onReadable() {
+            if (!connected()) {
+                return;
+            }
+            if (PQconsumeInput(conn) != 1) {
+                std::cerr << "Lost database connection: " << PQerrorMessage(conn) << std::endl;
+                failAll();
+                return;
+            }
+            while (!awaiting.empty() && !PQisBusy(conn)) {
+                PGresult* res = PQgetResult(conn);
+                if (res == nullptr) {
+                    // End of one query's results, or nothing left to read yet
+                    if (!currentDelivered) {
+                        break;
+                    }
+                    awaiting.pop_front();
+                    currentDelivered = false;
+                    continue;
+                }
+                ExecStatusType status = PQresultStatus(res);
+                PendingQuery pending = awaiting.front();
+                if (status == PGRES_PIPELINE_SYNC) {
+                    awaiting.pop_front();
+                    bool ok = !groupFailed;
+                    groupFailed = false;
+                    PQclear(res);
+                    if (pending.isSync && pending.onSync) {
+                        pending.onSync(ok);
+                    }
+                    continue;
+                }
+                if (status == PGRES_FATAL_ERROR || status == PGRES_PIPELINE_ABORTED) {
+                    if (status == PGRES_FATAL_ERROR) {
+                        std::cerr << "Query failed: " << PQresultErrorMessage(res) << std::endl;
+                    }
+                    groupFailed = true;
+                }
+                if (!pending.isSync && pending.onResult && !currentDelivered) {
+                    pending.onResult(res);
+                }
+                currentDelivered = true;
+                PQclear(res);
+            }
+        }
+
+        // Completes everything outstanding as failed, then reconnects
+        void failAll() {
+            std::deque<PendingQuery> failed;
+            failed.swap(awaiting);
+            currentDelivered = false;
+            groupFailed = false;
+            for (PendingQuery& pending : failed) {
+                if (pending.isSync) {
+                    if (pending.onSync) pending.onSync(false);
+                } else if (pending.onResult) {
+                    pending.onResult(nullptr);
+                }
+            }
+            reconnect();
+        }
+
+        bool reconnect() {
+            if (std::chrono::steady_clock::now() - lastConnectAttempt < RECONNECT_INTERVAL) {
+                return false;
+            }
+            if (conn != nullptr) {
+                PQfinish(conn);
+                conn = nullptr;
+            }
+            return connect(connectionString);
+        }
+
+        ~AsyncDatabase() {
+            if (conn != nullptr) {
+                PQfinish(conn);
+            }
+        }
+};
+
+#endif
@@ -6,7 +6,9 @@
 #include <vector>
 #include <string>
 #include <exception>
-#endif
+
+const char* INSERT_BOOKING_SQL = "INSERT INTO booking (facility_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute, booking_status, booking_week) VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) RETURNING booking_id";
+const char* UPDATE_BOOKING_SQL = "UPDATE booking SET facility_id = $1, username = $2, start_day = $3, start_hour = $4, start_minute = $5, end_day = $6, end_hour = $7, end_minute = $8, booking_status = $9 WHERE booking_id = $10 RETURNING booking_id";
 
 enum BookingStatus {
     pending = 0,
@@ -99,66 +101,28 @@ class Booking {
             return false;
         }
 
-        void saveToDatabase() {
-            // Save booking to database
-            try {
-                pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
-                if (conn.is_open()) {
-                    std::cout << "Connected to database" << std::endl;
-                } else {
-                    std::cerr << "Failed to connect to database" << std::endl;
-                    return;
-                }
-                pqxx::work txn(conn);
-                pqxx::result res;
-                if (this->bookingID != "") {
-                    res = txn.exec(
-                        "UPDATE booking SET facility_id = $1, username = $2, start_day = $3, start_hour = $4, start_minute = $5, end_day = $6, end_hour = $7, end_minute = $8, booking_status = $9 WHERE booking_id = $10 RETURNING booking_id",
-                        pqxx::params(
-                            this->facilityId,
-                            this->userName,
-                            this->bookingStartDay,
-                            this->bookingStartHour,
-                            this->bookingStartMinute,
-                            this->bookingEndDay,
-                            this->bookingEndHour,
-                            this->bookingEndMinute,
-                            this->bookingStatus,
-                            this->bookingID
-                        )
-                    );
-                } else {
-
-                    res = txn.exec(
-                        "INSERT INTO booking (facility_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute, booking_status) VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9) RETURNING booking_id",
-                        pqxx::params(
-                            this->facilityId,
-                            this->userName,
-                            this->bookingStartDay,
-                            this->bookingStartHour,
-                            this->bookingStartMinute,
-                            this->bookingEndDay,
-                            this->bookingEndHour,
-                            this->bookingEndMinute,
-                            this->bookingStatus
-                        )
-                    );
-                }
-                txn.commit();
-                if (res.size() > 0) {
-                    this->bookingID = res[0][0].as<std::string>();
-                    std::cout << "Booking saved with ID: " << this->bookingID << std::endl;
-                } else {
-                    std::cerr << "Failed to save booking" << std::endl;
-                }
-                conn.close();
-            }
-            catch (const std::exception &e) {
-                std::cerr << "Error saving booking: " << e.what() << std::endl;
+        // Parameters for UPDATE_BOOKING_SQL if the booking has an ID. INSERT_BOOKING_SQL
+        // also takes the schedule week, see Retention::insertParams.
+        std::vector<std::string> databaseParams() const {
+            std::vector<std::string> params = {
+                this->facilityId,
+                this->userName,
+                std::to_string(this->bookingStartDay),
+                std::to_string(this->bookingStartHour),
+                std::to_string(this->bookingStartMinute),
+                std::to_string(this->bookingEndDay),
+                std::to_string(this->bookingEndHour),
+                std::to_string(this->bookingEndMinute),
+                std::to_string(this->bookingStatus)
+            };
+            if (this->bookingID != "") {
+                params.push_back(this->bookingID);
             }
+            return params;
         }
 
-        int changeBookingMinutes(int change) {
+        // Moves the booking in memory only; the caller is responsible for saving it
+        int shiftBookingMinutes(int change) {
             // Change booking start time by a certain number of minutes, changes should not be accross days
             uint currentBookingStart = this->bookingStartHour * 60 + this->bookingStartMinute;
             uint currentBookingEnd = this->bookingEndHour * 60 + this->bookingEndMinute;
@@ -170,11 +134,12 @@ class Booking {
                 this->bookingStartMinute = (uint)newBookingStart % 60;
                 this->bookingEndHour = (uint)newBookingEnd / 60;
                 this->bookingEndMinute =(uint)newBookingEnd % 60;
-                this->saveToDatabase();
                 return 0;
             } else {
                 std::cerr << "Invalid booking time" << std::endl;
                 return 1;
             }
         }
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef BOOKINGSTORE_CPP
+#define BOOKINGSTORE_CPP
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include "bookings.cpp"
+
+// Minutes since Monday 00:00. A week has 10080 of them, so start and end
+// times fit in 16 bits.
+typedef uint16_t WeekMinute;
+const uint MINUTES_PER_DAY = 24 * 60;
+
+// Booking ID of a booking the database has not numbered yet
+const uint32_t NO_BOOKING_ID = 0;
+
+bool validWeekTime(uint day, uint hour, uint minute) {
+    return day < 7 && hour < 24 && minute < 60;
+}
+
+WeekMinute toWeekMinute(uint day, uint hour, uint minute) {
+    return (WeekMinute)(day * MINUTES_PER_DAY + hour * 60 + minute);
+}
+
+uint weekDay(WeekMinute time) {
+    return time / MINUTES_PER_DAY;
+}
+
+uint weekHour(WeekMinute time) {
+    return time % MINUTES_PER_DAY / 60;
+}
+
+uint weekMinute(WeekMinute time) {
+    return time % 60;
+}
+
+uint32_t bookingKey(const std::string& bookingID) {
+    return bookingID.empty() ? NO_BOOKING_ID : (uint32_t)strtoul(bookingID.c_str(), nullptr, 10);
+}
+
+std::string bookingIdString(uint32_t bookingId) {
+    return bookingId == NO_BOOKING_ID ? "" : std::to_string(bookingId);
+}
+
+// Keeps one copy of each distinct string and hands out its position instead
+class StringInterner {
+    public:
+        // A deque never moves its elements, so the views used as keys stay valid
+        std::deque<std::string> strings;
+        std::unordered_map<std::string_view, uint32_t> positions;
+
+        uint32_t intern(const std::string& value) {
+            auto found = positions.find(value);
+            if (found != positions.end()) {
+                return found->second;
+            }
+            strings.push_back(value);
+            uint32_t position = (uint32_t)strings.size() - 1;
+            positions.emplace(strings.back(), position);
+            return position;
+        }
+
+        bool find(const std::string& value, uint32_t& position) const {
+            auto found = positions.find(value);
+            if (found == positions.end()) {
+                return false;
+            }
+            position = found->second;
+            return true;
+        }
+
+        const std::string& get(uint32_t position) const {
+            return strings[position];
+        }
+};
+
+StringInterner userNames;
+
+// A facility's bookings as parallel columns. Conflict checks and availability
+// scans only touch the time and status columns, and a booking costs about 12
+// bytes instead of a Booking with three strings. Booking objects are built
+// with toBooking() where the rest of the server needs one.
+class BookingStore {
+    public:
+        std::vector<uint32_t> ids;
+        std::vector<uint32_t> users;
+        std::vector<WeekMinute> starts;
+        std::vector<WeekMinute> ends;
+        // Four 2 bit BookingStatus values per byte
+        std::vector<uint8_t> statusBits;
+
+        size_t size() const {
+            return ids.size();
+        }
+
+        size_t append(uint32_t bookingId, uint32_t user, WeekMinute start, WeekMinute end, uint status) {
+            size_t index = ids.size();
+            ids.push_back(bookingId);
+            users.push_back(user);
+            starts.push_back(start);
+            ends.push_back(end);
+            if (index % 4 == 0) {
+                statusBits.push_back(0);
+            }
+            setStatus(index, status);
+            return index;
+        }
+
+        uint status(size_t index) const {
+            return (statusBits[index / 4] >> (index % 4 * 2)) & 3;
+        }
+
+        void setStatus(size_t index, uint status) {
+            uint8_t& bits = statusBits[index / 4];
+            int shift = index % 4 * 2;
+            bits = (uint8_t)((bits & ~(3 << shift)) | ((status & 3) << shift));
+        }
+
+        uint day(size_t index) const {
+            return weekDay(starts[index]);
+        }
+
+        Booking toBooking(size_t index, const std::string& facilityId) const {
+            return Booking(facilityId, weekDay(starts[index]), weekHour(starts[index]), weekMinute(starts[index]),
+                           weekDay(ends[index]), weekHour(ends[index]), weekMinute(ends[index]),
+                           userNames.get(users[index]), bookingIdString(ids[index]), status(index));
+        }
+
+        // Copies times, owner and status from a booking changed through the Booking API
+        void assign(size_t index, const Booking& booking) {
+            users[index] = userNames.intern(booking.userName);
+            starts[index] = toWeekMinute(booking.bookingStartDay, booking.bookingStartHour, booking.bookingStartMinute);
+            ends[index] = toWeekMinute(booking.bookingEndDay, booking.bookingEndHour, booking.bookingEndMinute);
+            setStatus(index, booking.bookingStatus);
+        }
+
+        size_t memoryBytes() const {
+            return ids.capacity() * sizeof(uint32_t) + users.capacity() * sizeof(uint32_t) +
+                   starts.capacity() * sizeof(WeekMinute) + ends.capacity() * sizeof(WeekMinute) + statusBits.capacity();
+        }
+};
+
+#endif
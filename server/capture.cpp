@@ -0,0 +1,143 @@
+#ifndef CAPTURE_CPP
+#define CAPTURE_CPP
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <arpa/inet.h>
+
+// Trace file layout: the 8 byte magic, then one record per datagram. All
+// integers are in network byte order.
+//   [8 bytes timestamp in ns since capture start]
+//   [4 bytes client IP][2 bytes client port]
+//   [1 byte direction][1 byte padding]
+//   [4 bytes length][datagram]
+const char TRACE_MAGIC[8] = {'F', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+const size_t TRACE_RECORD_HEADER = 20;
+const size_t TRACE_BUFFER_SIZE = 1 << 20;
+
+// Callbacks are monitor datagrams the server sends on its own, after the
+// subscribe request was answered
+enum TraceDirection {
+    traceRequest = 0,
+    traceReply = 1,
+    traceCallback = 2
+};
+
+struct TraceRecord {
+    uint64_t timestampNs;
+    uint32_t ip;
+    uint16_t port;
+    uint8_t direction;
+    std::vector<unsigned char> bytes;
+};
+
+void putUint64(unsigned char* p, uint64_t value) {
+    uint32_t high = htonl((uint32_t)(value >> 32));
+    uint32_t low = htonl((uint32_t)value);
+    memcpy(p, &high, sizeof(high));
+    memcpy(p + 4, &low, sizeof(low));
+}
+
+uint64_t getUint64(const unsigned char* p) {
+    uint32_t high, low;
+    memcpy(&high, p, sizeof(high));
+    memcpy(&low, p + 4, sizeof(low));
+    return ((uint64_t)ntohl(high) << 32) | ntohl(low);
+}
+
+// Appends datagrams to a trace file. Writes go through a large stdio
+// buffer so recording costs a memcpy per datagram on the hot path. The
+// listener records requests and replies and the notification thread
+// records monitor callbacks, so a record is written under the mutex.
+class TrafficCapture {
+    public:
+        std::mutex mtx;
+        FILE* file = nullptr;
+        std::vector<char> fileBuffer;
+        std::chrono::steady_clock::time_point started;
+
+        bool open(const std::string& path) {
+            file = fopen(path.c_str(), "wb");
+            if (file == nullptr) {
+                perror("Failed to open capture file");
+                return false;
+            }
+            fileBuffer.resize(TRACE_BUFFER_SIZE);
+            setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+            fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), file);
+            started = std::chrono::steady_clock::now();
+            std::cout << "Capturing traffic to " << path << std::endl;
+            return true;
+        }
+
+        void record(TraceDirection direction, const sockaddr_in& address, const void* bytes, size_t length) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (file == nullptr) {
+                return;
+            }
+            unsigned char header[TRACE_RECORD_HEADER];
+            uint64_t timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+            putUint64(header, timestampNs);
+            memcpy(header + 8, &address.sin_addr.s_addr, 4);
+            memcpy(header + 12, &address.sin_port, 2);
+            header[14] = (unsigned char)direction;
+            header[15] = 0;
+            uint32_t networkLength = htonl((uint32_t)length);
+            memcpy(header + 16, &networkLength, sizeof(networkLength));
+            fwrite(header, 1, sizeof(header), file);
+            fwrite(bytes, 1, length, file);
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (file != nullptr) {
+                fclose(file);
+                file = nullptr;
+                std::cout << "Capture file closed" << std::endl;
+            }
+        }
+
+        ~TrafficCapture() {
+            close();
+        }
+};
+
+bool readTrace(const std::string& path, std::vector<TraceRecord>& records) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        perror("Failed to open trace");
+        return false;
+    }
+    char magic[sizeof(TRACE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        std::cerr << "Not a trace file: " << path << std::endl;
+        fclose(file);
+        return false;
+    }
+    unsigned char header[TRACE_RECORD_HEADER];
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        TraceRecord record;
+        record.timestampNs = getUint64(header);
+        memcpy(&record.ip, header + 8, 4);
+        memcpy(&record.port, header + 12, 2);
+        record.direction = header[14];
+        uint32_t length;
+        memcpy(&length, header + 16, sizeof(length));
+        length = ntohl(length);
+        record.bytes.resize(length);
+        if (fread(record.bytes.data(), 1, length, file) != length) {
+            // A capture cut off mid-record (e.g. the server was killed) keeps what came before
+            std::cerr << "Trace truncated after " << records.size() << " records" << std::endl;
+            break;
+        }
+        records.push_back(std::move(record));
+    }
+    fclose(file);
+    return true;
+}
+
+#endif
@@ -5,10 +5,19 @@
 #include <pqxx/pqxx>
 #include "message.cpp"
 #include "facility.cpp"
+#include "tokens.cpp"
+#include "loader.cpp"
+#include "admission.cpp"
+#include "capture.cpp"
+#include "asyncdb.cpp"
+#include "monitor.cpp"
+#include "retention.cpp"
 #include <vector>
 #include <cmath>
 #include <atomic>
 #include <unordered_map>
+#include <unordered_set>
+#include <functional>
 #include <thread>
 #include <map>
 #include <csignal>
@@ -17,24 +26,14 @@
 #include <string>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 
-std::string generate6DigitCode() {
-    std::random_device rd;  // non-deterministic generator
-    std::mt19937 gen(rd()); // Mersenne Twister RNG
-    std::uniform_int_distribution<> dist(0, 999999);
-
-    int code = dist(gen);
-    
-    // Pad with leading zeros to make it 6 digits
-    char buffer[7]; // 6 digits + null terminator
-    snprintf(buffer, sizeof(buffer), "%06d", code);
-    return std::string(buffer);
-}
-
-
-
 std::atomic<bool> running(true);
+// The notification thread keeps listening until the shutdown snapshot is
+// written, and says whether it is listening at all
+std::atomic<bool> notificationsRunning(true);
+std::atomic<bool> notificationsListening(false);
 void handleSignal(int) {
     std::cout << "Received signal to terminate. Cleaning up..." << std::endl;
     running = false;
@@ -45,24 +44,40 @@ enum {
     POSTPONE = 1
 };
 
-struct MonitorClients {
-    int socket_fd;
-    sockaddr_in clientAddress;
-    socklen_t clientAddressLength = sizeof(clientAddress);
-    std::chrono::steady_clock::time_point expires;
-    Message msg;
+// Filter flags for viewing a user's bookings
+enum {
+    USER_FILTER_FACILITY = 1,
+    USER_FILTER_DAYS = 2,
+    USER_FILTER_STATUS = 4
+};
+
+// Bulk booking modes and ways of listing slots
+enum {
+    BULK_ALL_OR_NOTHING = 0,
+    BULK_BEST_EFFORT = 1
 };
 
-std::unordered_multimap<std::string, MonitorClients> clients;
+enum {
+    SLOTS_EXPLICIT = 0,
+    SLOTS_RECURRING = 1
+};
 
-std::unordered_multimap<std::string, std::unordered_map<uint32_t, std::string>> prevRequestData;
+// Replies already sent, by client (IP and port) and request ID
+std::unordered_map<std::string, std::unordered_map<uint32_t, std::string>> prevRequestData;
+
+// Largest UDP payload over IPv4. Requests are read whole: a bulk booking
+// with 255 explicit slots and long names does not fit in 1 KB.
+const size_t MAX_DATAGRAM_SIZE = 65507;
+
+// How long shutdown waits for database work already sent
+const std::chrono::seconds DATABASE_DRAIN_TIMEOUT(2);
 
 class Connection {
     public :
         int socket_fd;
         sockaddr_in serverAddress, clientAddress;
         socklen_t clientAddressLength = sizeof(clientAddress);
-        unsigned char buffer[1024];
+        unsigned char buffer[MAX_DATAGRAM_SIZE];
         Connection(int port = 8014):buffer{0} {
             socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
             serverAddress.sin_family = AF_INET;
@@ -80,435 +95,1213 @@ class Connection {
             close(socket_fd);
             std::cout << "Socket closed" << std::endl;
         }
+        AdmissionController admission;
+        TrafficCapture capture;
+        AsyncDatabase db;
+        // Requests waiting on the database, by client and request ID. A
+        // retransmission that arrives meanwhile is dropped; the reply answers it.
+        std::unordered_map<std::string, std::unordered_set<uint32_t>> inFlightRequests;
+        // Set while a write is dispatched with a database ticket; a request that
+        // suspends takes the ticket over and gives it back when it resumes
+        bool holdingDatabase = false;
+        // Facility reloads sent and not answered yet
+        int reloadsInFlight = 0;
+
         void listen() {
+            int flags = fcntl(socket_fd, F_GETFL, 0);
+            fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+            db.connect("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
+
             while (running) {
+                // Wait for traffic or database results unless admitted requests can be served now
+                int timeout = admission.hasServable(!retention.holdsWrites()) ? 0 : (admission.hasPending() ? 10 : 100);
+                pollDatabaseAnd(socket_fd, timeout);
+                receiveBatch();
+                serveQueues();
+                reloadExternalChanges();
+                retention.tick(db);
+            }
+            // Let writes already sent finish so their clients get an answer, and
+            // apply outstanding external changes so the snapshot can be written
+            auto drainDeadline = std::chrono::steady_clock::now() + DATABASE_DRAIN_TIMEOUT;
+            while ((db.inFlight() > 0 || !externalChanges.empty()) && std::chrono::steady_clock::now() < drainDeadline) {
+                reloadExternalChanges();
+                pollDatabaseAnd(-1, 100);
+            }
+            std::cout << "Exiting listen loop" << std::endl;
+            std::cout << "Closing socket" << std::endl;
+            close(socket_fd);
+            std::cout << "Socket closed" << std::endl;
+        }
 
-                int flags = fcntl(socket_fd, F_GETFL, 0);
-                fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+        // Memory matches the database: none of our writes or reloads are in
+        // flight and every change announced by another session has been applied
+        bool inSync() {
+            return db.inFlight() == 0 && externalChanges.empty() && notificationsListening;
+        }
+
+        // Rereads the facilities another session wrote to and applies their rows
+        // to memory. Results arrive in pipeline order, so every write this
+        // server sent earlier has landed by then. A booking change sent later
+        // would be undone by the older rows, so the reload is put off while the
+        // facility has one in flight, and while a week rollover is, so that the
+        // rows it archives are gone before they are read.
+        void reloadExternalChanges() {
+            if (!db.connected() || retention.holdsWrites()) {
+                return;
+            }
+            for (const std::string& facilityName : externalChanges.take()) {
+                facility* fac = facilities.find(facilityName);
+                if (fac == nullptr) {
+                    // Not resident yet; its rows are read when it is first used
+                    continue;
+                }
+                if (fac->pendingModifies > 0) {
+                    externalChanges.add(facilityName);
+                    continue;
+                }
+                auto rows = std::make_shared<std::vector<Booking>>();
+                std::string facilityId = fac->facilityId;
+                reloadsInFlight++;
+                db.send(RELOAD_FACILITY_SQL, {facilityId}, [rows, facilityId](PGresult* res) {
+                    if (res == nullptr || PQresultStatus(res) != PGRES_TUPLES_OK) {
+                        return;
+                    }
+                    for (int i = 0; i < PQntuples(res); i++) {
+                        rows->emplace_back(facilityId,
+                                           (uint)atoi(PQgetvalue(res, i, 2)), (uint)atoi(PQgetvalue(res, i, 3)), (uint)atoi(PQgetvalue(res, i, 4)),
+                                           (uint)atoi(PQgetvalue(res, i, 5)), (uint)atoi(PQgetvalue(res, i, 6)), (uint)atoi(PQgetvalue(res, i, 7)),
+                                           PQgetvalue(res, i, 1), PQgetvalue(res, i, 0), (uint)atoi(PQgetvalue(res, i, 8)));
+                    }
+                });
+                db.sync([this, fac, facilityName, rows](bool ok) {
+                    reloadsInFlight--;
+                    if (!ok || fac->pendingModifies > 0) {
+                        externalChanges.add(facilityName);
+                        return;
+                    }
+                    uint8_t changedDays = 0;
+                    std::vector<uint32_t> unbooked;
+                    size_t changed = fac->reconcile(*rows, changedDays, unbooked);
+                    monitors.publishDays(facilityName, changedDays);
+                    for (const Booking& row : *rows) {
+                        tokenIndex.updateBooking(row);
+                    }
+                    for (uint32_t bookingId : unbooked) {
+                        tokenIndex.removeBooking(bookingIdString(bookingId));
+                    }
+                    std::cout << "Reloaded facility " << facilityName << ", " << changed << " bookings changed" << std::endl;
+                });
+            }
+        }
 
-                memset(buffer, 0, sizeof(buffer));
+        // Waits on the given socket (if any) and the database connection, and
+        // completes whatever database work has been answered
+        void pollDatabaseAnd(int fd, int timeout) {
+            pollfd pfds[2];
+            nfds_t count = 0;
+            if (fd >= 0) {
+                pfds[count++] = {fd, POLLIN, 0};
+            }
+            int dbSocket = db.socket();
+            if (dbSocket >= 0) {
+                pfds[count++] = {dbSocket, (short)(POLLIN | (db.wantsWrite() ? POLLOUT : 0)), 0};
+            }
+            if (poll(pfds, count, timeout) < 0 && errno != EINTR) {
+                std::cerr << "Poll failed: " << strerror(errno) << std::endl;
+                return;
+            }
+            if (dbSocket >= 0) {
+                short events = pfds[count - 1].revents;
+                if (events & POLLOUT) {
+                    db.onWritable();
+                }
+                if (events & (POLLIN | POLLERR | POLLHUP)) {
+                    db.onReadable();
+                }
+            }
+        }
 
-                int n = recvfrom(socket_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&clientAddress, &clientAddressLength);
+        // Reads whatever is waiting on the socket, classifies it and either
+        // queues it or tells the client to back off
+        void receiveBatch() {
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < ADMISSION_BATCH_SIZE; i++) {
+                sockaddr_in fromAddress;
+                socklen_t fromAddressLength = sizeof(fromAddress);
+                int n = recvfrom(socket_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&fromAddress, &fromAddressLength);
                 if (n < 0) {
-                    if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                        // No data available, check if we should exit
-                        if (!running) break;
-                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                        continue;
-                    } else {
+                    if (errno != EWOULDBLOCK && errno != EAGAIN) {
                         std::cerr << "Receive failed: " << strerror(errno) << std::endl;
                     }
+                    break;
+                }
+                capture.record(traceRequest, fromAddress, buffer, n);
+                if (n < 6) {
+                    std::cerr << "Dropping datagram shorter than a header" << std::endl;
+                    continue;
                 }
                 char ipStr[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &(clientAddress.sin_addr), ipStr, INET_ADDRSTRLEN);
-                std::cout << "Received packet from " << ipStr << ":" << ntohs(clientAddress.sin_port) << std::endl;
-
-        
-                // sendto(socket_fd, buffer, n, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
-                Message msg(buffer, n);
-                std::cout << "Request Type: " << (int)msg.msg.requestType << std::endl;
-                std::cout << "Request ID: " << msg.msg.requestID << std::endl;
-                std::cout << "Choice: " << (int)msg.msg.choice << std::endl;
-                auto prevRequestsFromIP = prevRequestData.equal_range(ipStr);
-                bool sent = false;
-                for (auto it = prevRequestsFromIP.first; it != prevRequestsFromIP.second; ++it) {
-                    auto& responseMap = it->second;
-
-                    auto found  = responseMap.find(msg.msg.requestID);
-                    if (found != responseMap.end()) {
-                        std::string responseStr = found->second;
-                        const char* response = responseStr.c_str();
-                        std::cout << "Found previous response for request ID: " << msg.msg.requestID << std::endl;
-                        sendto(socket_fd, response, responseStr.size(), 0, (struct sockaddr *)&clientAddress, clientAddressLength);
-                        std::cout << "Sent previous response to client" << std::endl;
-                        sent = true;
-                        continue;
-                    }
+                inet_ntop(AF_INET, &(fromAddress.sin_addr), ipStr, INET_ADDRSTRLEN);
+                std::cout << "Received packet from " << ipStr << ":" << ntohs(fromAddress.sin_port) << std::endl;
 
-                }
-                if (sent) {
-                    std::cout << "Previous response sent" << std::endl;
+                Datagram datagram;
+                datagram.clientAddress = fromAddress;
+                datagram.clientKey = std::string(ipStr) + ":" + std::to_string(ntohs(fromAddress.sin_port));
+                datagram.bytes.assign(buffer, buffer + n);
+                datagram.arrival = now;
+                uint32_t requestID;
+                memcpy(&requestID, buffer + 1, sizeof(requestID));
+                requestID = ntohl(requestID);
+                bool answered = findPreviousReply(datagram.clientKey, requestID) != nullptr || isInFlight(datagram.clientKey, requestID);
+                datagram.priority = AdmissionController::classify(buffer[5], answered);
+
+                uint32_t retryAfterMs;
+                if (!admission.allow(datagram.clientKey, datagram.priority, now, retryAfterMs)) {
+                    std::cout << "Rate limited " << datagram.clientKey << std::endl;
+                    sendBusy(datagram, retryAfterMs);
                     continue;
                 }
-                std::cout << "Received: " << buffer << std::endl;
-                uint32_t facilityNameLength;
-                std::string facilityName;
-                switch ((int)msg.msg.choice)
-                {
-                case 1: {
-                    memcpy(&facilityNameLength, msg.msg.messageData.data(), sizeof(facilityNameLength));
-                    facilityNameLength = ntohl(facilityNameLength);
-                    facilityName = std::string((char*)msg.msg.messageData.data() + 4, static_cast<size_t>(facilityNameLength));
-                    std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
-                    std::cout << "Facility Name: " << facilityName << std::endl;
-                    // Check for availability
-                    facility fac(facilityName);
-                    std::cout << "Facility ID: " << fac.facilityId << std::endl;
-                    char maskedDaysBit;
-                    memcpy(&maskedDaysBit, msg.msg.messageData.data() + 4 + facilityNameLength, sizeof(maskedDaysBit));
-                    std::vector<int> days;
-                    while (maskedDaysBit > 0) {
-                        int day = floor(log2(maskedDaysBit));
-                        days.push_back(day);
-                        maskedDaysBit = maskedDaysBit - pow(2, day);
-                    }
-                    std::cout << "Days: ";
-                    for (int i = 0; i < days.size(); i++) {
-                        std::cout << days[i] << " ";
-                    }
-                    std::cout << std::endl;
-                    std::map<uint, std::map<uint, uint>> bookedSlots;
-                    for (int i = 0; i < days.size(); i++) {
-                        bookedSlots[days[i]] = fac.getBookingTimes(days[i]);
+                admission.enqueue(std::move(datagram));
+            }
+            admission.sweep(now);
+        }
+
+        // Serves queued requests in priority order. Writes need a database
+        // ticket; once the budget is in flight control returns to the event
+        // loop so results and newly arrived cheap requests are handled.
+        void serveQueues() {
+            for (int priority = 0; priority < priorityCount; priority++) {
+                std::deque<Datagram>& queue = admission.queues[priority];
+                while (!queue.empty()) {
+                    if (admission.expired(queue.front(), std::chrono::steady_clock::now())) {
+                        std::cout << "Shedding request from " << queue.front().clientKey << std::endl;
+                        sendBusy(queue.front(), PRIORITY_MAX_DELAY[priority].count());
+                        queue.pop_front();
+                        continue;
                     }
-                    std::vector<unsigned char> data;
-                    data.push_back((unsigned char) days.size());
-                    std::cout << "Number of days: " << days.size() << std::endl;
-                    for (const auto& [day, slots] : bookedSlots) {
-                        std::cout << "Day: " << day << std::endl;
-                        data.push_back((unsigned char)day);
-                        data.push_back((unsigned char)slots.size());
-                        for (const auto& [start, end] : slots) {
-                            std::cout << "Start: " << start << ", End: " << end << std::endl;
-                            data.push_back((unsigned char)(start / 100));
-                            data.push_back((unsigned char)(start % 100));
-                            data.push_back((unsigned char)(end / 100));
-                            data.push_back((unsigned char)(end % 100));
-                        }
+                    if (priority == priorityWrite && (retention.holdsWrites() || !admission.tryAcquireDatabase())) {
+                        return;
+                    }
+                    Datagram datagram = std::move(queue.front());
+                    queue.pop_front();
+                    holdingDatabase = priority == priorityWrite;
+                    dispatch(datagram);
+                    if (holdingDatabase) {
+                        admission.releaseDatabase();
+                        holdingDatabase = false;
                     }
-                    auto [total_length, replyBuffer] = msg.createReply(data);
-                    std::unordered_map<uint32_t, std::string> responseMap;
-                    responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);
-                    prevRequestData.emplace(ipStr, responseMap);
-                    sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
-                    break;
                 }
-                case 2: {
-                    int offset = 0;
-                    uint32_t userNameLength;
-                    memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
-                    userNameLength = ntohl(userNameLength);
-                    offset += sizeof(userNameLength);
-                    std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
-                    offset += userNameLength;
-                    std::cout << "User Name Length: " << userNameLength << std::endl;
-                    std::cout << "User Name: " << userName << std::endl;
-                    memcpy(&facilityNameLength, msg.msg.messageData.data() + offset, sizeof(facilityNameLength));
-                    facilityNameLength = ntohl(facilityNameLength);
-                    offset += sizeof(facilityNameLength);
-                    facilityName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(facilityNameLength));
-                    offset += facilityNameLength;
-                    std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
-                    std::cout << "Facility Name: " << facilityName << std::endl;
-                    uint8_t startDay, startHour, startMinute;
-                    // std::cout << "Raw bytes (hex) at offset " << offset << ": ";
-                    // for (size_t i = 0; i < sizeof(startDay); i++) {
-                    //     printf("%02X ", static_cast<uint8_t>(msg.msg.messageData.data()[offset + i]));
-                    // }
-                    std::cout << std::endl;
-                    memcpy(&startDay, msg.msg.messageData.data() + offset, sizeof(startDay));
-                    offset += sizeof(startDay);
-                    memcpy(&startHour, msg.msg.messageData.data() + offset, sizeof(startHour));
-                    offset += sizeof(startHour);
-                    memcpy(&startMinute, msg.msg.messageData.data() + offset, sizeof(startMinute));
-                    offset += sizeof(startMinute);
-                    std::cout << "Start Day: " << (int)startDay << std::endl;
-                    std::cout << "Start Hour: " << (int)startHour << std::endl;
-                    std::cout << "Start Minute: " << (int)startMinute << std::endl;
-                    uint8_t endDay, endHour, endMinute;
-                    memcpy(&endDay, msg.msg.messageData.data() + offset, sizeof(endDay));
-                    offset += sizeof(endDay);
-                    memcpy(&endHour, msg.msg.messageData.data() + offset, sizeof(endHour));
-                    offset += sizeof(endHour);
-                    memcpy(&endMinute, msg.msg.messageData.data() + offset, sizeof(endMinute));
-                    offset += sizeof(endMinute);
-                    std::cout << "End Day: " << (int)endDay << std::endl;
-                    std::cout << "End Hour: " << (int)endHour << std::endl;
-                    std::cout << "End Minute: " << (int)endMinute << std::endl;
-                    // Check for booking
-                    facility fac(facilityName);
-                    std::cout << "Facility ID: " << fac.facilityId << std::endl;
-
-                    auto [bookingStatus, bookingResult] = fac.addBooking(startDay, startHour, startMinute, endDay, endHour, endMinute, userName);
-                    std::cout << "Booking Status: " << bookingStatus << std::endl;
-                    std::cout << "Booking Result: " << bookingResult << std::endl;
+            }
+        }
+
+        void sendReply(const sockaddr_in& address, const void* bytes, size_t length) {
+            sendto(socket_fd, bytes, length, 0, (struct sockaddr *)&address, sizeof(address));
+            capture.record(traceReply, address, bytes, length);
+        }
+
+        const std::string* findPreviousReply(const std::string& clientKey, uint32_t requestID) {
+            auto client = prevRequestData.find(clientKey);
+            if (client == prevRequestData.end()) {
+                return nullptr;
+            }
+            auto found = client->second.find(requestID);
+            if (found == client->second.end()) {
+                return nullptr;
+            }
+            return &found->second;
+        }
+
+        bool isInFlight(const std::string& clientKey, uint32_t requestID) {
+            auto client = inFlightRequests.find(clientKey);
+            return client != inFlightRequests.end() && client->second.count(requestID) > 0;
+        }
+
+        // Marks a request as waiting on the database. Returns whether it took
+        // over the dispatch's database ticket, which resume() hands back.
+        bool suspend(const Message& msg, const std::string& clientKey) {
+            inFlightRequests[clientKey].insert(msg.msg.requestID);
+            bool tookTicket = holdingDatabase;
+            holdingDatabase = false;
+            return tookTicket;
+        }
+
+        // Answers a suspended request from a database callback
+        void resume(Message& msg, const std::string& clientKey, const sockaddr_in& address, bool tookTicket, const std::vector<unsigned char>& data, uint8_t errorCode, bool remember = true) {
+            auto [total_length, replyBuffer] = msg.createReply(data, errorCode);
+            if (remember) {
+                prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+            }
+            sendReply(address, replyBuffer, total_length);
+            delete[] replyBuffer;
+            auto client = inFlightRequests.find(clientKey);
+            if (client != inFlightRequests.end()) {
+                client->second.erase(msg.msg.requestID);
+                if (client->second.empty()) {
+                    inFlightRequests.erase(client);
+                }
+            }
+            if (tookTicket) {
+                admission.releaseDatabase();
+            }
+        }
+
+        void sendBusy(const Datagram& datagram, uint32_t retryAfterMs) {
+            // Busy replies are not remembered so that the retry is actually executed
+            Message msg(const_cast<unsigned char*>(datagram.bytes.data()), datagram.bytes.size());
+            std::vector<unsigned char> data;
+            uint32_t retryAfter = htonl(retryAfterMs);
+            data.insert(data.end(), (unsigned char*)&retryAfter, (unsigned char*)&retryAfter + sizeof(retryAfter));
+            auto [total_length, replyBuffer] = msg.createReply(data, BUSY_ERROR_CODE);
+            sendReply(datagram.clientAddress, replyBuffer, total_length);
+            delete[] replyBuffer;
+        }
+
+        void dispatch(const Datagram& datagram) {
+            clientAddress = datagram.clientAddress;
+            clientAddressLength = sizeof(clientAddress);
+            const std::string& clientKey = datagram.clientKey;
+            Message msg(const_cast<unsigned char*>(datagram.bytes.data()), datagram.bytes.size());
+            std::cout << "Request Type: " << (int)msg.msg.requestType << std::endl;
+            std::cout << "Request ID: " << msg.msg.requestID << std::endl;
+            std::cout << "Choice: " << (int)msg.msg.choice << std::endl;
+            const std::string* previousReply = findPreviousReply(clientKey, msg.msg.requestID);
+            if (previousReply != nullptr) {
+                std::cout << "Found previous response for request ID: " << msg.msg.requestID << std::endl;
+                sendReply(clientAddress, previousReply->data(), previousReply->size());
+                std::cout << "Previous response sent" << std::endl;
+                return;
+            }
+            if (isInFlight(clientKey, msg.msg.requestID)) {
+                std::cout << "Request ID " << msg.msg.requestID << " is still waiting on the database" << std::endl;
+                return;
+            }
+            uint32_t facilityNameLength;
+            std::string facilityName;
+            switch ((int)msg.msg.choice)
+            {
+            case 1: {
+                memcpy(&facilityNameLength, msg.msg.messageData.data(), sizeof(facilityNameLength));
+                facilityNameLength = ntohl(facilityNameLength);
+                facilityName = std::string((char*)msg.msg.messageData.data() + 4, static_cast<size_t>(facilityNameLength));
+                std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
+                std::cout << "Facility Name: " << facilityName << std::endl;
+                // Check for availability
+                facility& fac = facilities.get(facilityName);
+                std::cout << "Facility ID: " << fac.facilityId << std::endl;
+                char maskedDaysBit;
+                memcpy(&maskedDaysBit, msg.msg.messageData.data() + 4 + facilityNameLength, sizeof(maskedDaysBit));
+                std::vector<int> days;
+                while (maskedDaysBit > 0) {
+                    int day = floor(log2(maskedDaysBit));
+                    days.push_back(day);
+                    maskedDaysBit = maskedDaysBit - pow(2, day);
+                }
+                std::cout << "Days: ";
+                for (int i = 0; i < days.size(); i++) {
+                    std::cout << days[i] << " ";
+                }
+                std::cout << std::endl;
+                // Days are sent in ascending order; each one is a cached fragment that is
+                // only rebuilt if a booking on that day changed since it was serialized
+                std::sort(days.begin(), days.end());
+                std::vector<unsigned char> data;
+                data.push_back((unsigned char) days.size());
+                std::cout << "Number of days: " << days.size() << std::endl;
+                for (int day : days) {
+                    const std::vector<unsigned char>& fragment = fac.availabilityFragment(day);
+                    data.insert(data.end(), fragment.begin(), fragment.end());
+                }
+                auto [total_length, replyBuffer] = msg.createReply(data);
+                prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                sendReply(clientAddress, replyBuffer, total_length);
+                break;
+            }
+            case 2: {
+                int offset = 0;
+                uint32_t userNameLength;
+                memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
+                userNameLength = ntohl(userNameLength);
+                offset += sizeof(userNameLength);
+                std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
+                offset += userNameLength;
+                std::cout << "User Name Length: " << userNameLength << std::endl;
+                std::cout << "User Name: " << userName << std::endl;
+                memcpy(&facilityNameLength, msg.msg.messageData.data() + offset, sizeof(facilityNameLength));
+                facilityNameLength = ntohl(facilityNameLength);
+                offset += sizeof(facilityNameLength);
+                facilityName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(facilityNameLength));
+                offset += facilityNameLength;
+                std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
+                std::cout << "Facility Name: " << facilityName << std::endl;
+                uint8_t startDay, startHour, startMinute;
+                // std::cout << "Raw bytes (hex) at offset " << offset << ": ";
+                // for (size_t i = 0; i < sizeof(startDay); i++) {
+                //     printf("%02X ", static_cast<uint8_t>(msg.msg.messageData.data()[offset + i]));
+                // }
+                std::cout << std::endl;
+                memcpy(&startDay, msg.msg.messageData.data() + offset, sizeof(startDay));
+                offset += sizeof(startDay);
+                memcpy(&startHour, msg.msg.messageData.data() + offset, sizeof(startHour));
+                offset += sizeof(startHour);
+                memcpy(&startMinute, msg.msg.messageData.data() + offset, sizeof(startMinute));
+                offset += sizeof(startMinute);
+                std::cout << "Start Day: " << (int)startDay << std::endl;
+                std::cout << "Start Hour: " << (int)startHour << std::endl;
+                std::cout << "Start Minute: " << (int)startMinute << std::endl;
+                uint8_t endDay, endHour, endMinute;
+                memcpy(&endDay, msg.msg.messageData.data() + offset, sizeof(endDay));
+                offset += sizeof(endDay);
+                memcpy(&endHour, msg.msg.messageData.data() + offset, sizeof(endHour));
+                offset += sizeof(endHour);
+                memcpy(&endMinute, msg.msg.messageData.data() + offset, sizeof(endMinute));
+                offset += sizeof(endMinute);
+                std::cout << "End Day: " << (int)endDay << std::endl;
+                std::cout << "End Hour: " << (int)endHour << std::endl;
+                std::cout << "End Minute: " << (int)endMinute << std::endl;
+                // Check for booking
+                facility& fac = facilities.get(facilityName);
+                std::cout << "Facility ID: " << fac.facilityId << std::endl;
+
+                if (!validWeekTime(startDay, startHour, startMinute) || !validWeekTime(endDay, endHour, endMinute)) {
+                    std::cerr << "Invalid booking time" << std::endl;
                     std::vector<unsigned char> data;
-                    data.push_back((unsigned char) bookingStatus);
+                    std::string bookingResult = "Invalid booking time";
+                    data.push_back((unsigned char) 1);
                     uint32_t bookingResultLength = htonl(bookingResult.size());
                     data.insert(data.end(), (unsigned char*)&bookingResultLength, (unsigned char*)&bookingResultLength + sizeof(bookingResultLength));
                     data.insert(data.end(), bookingResult.begin(), bookingResult.end());
                     auto [total_length, replyBuffer] = msg.createReply(data);
-                    std::unordered_map<uint32_t, std::string> responseMap;
-                    responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);
-                    prevRequestData.emplace(ipStr, responseMap);
-                    sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
                     break;
                 }
-                case 3: {
-                    int offset = 0;
-                    uint32_t userNameLength;
-                    memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
-                    userNameLength = ntohl(userNameLength);
-                    offset += sizeof(userNameLength);
-                    std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
-                    offset += userNameLength;
-                    std::cout << "User Name Length: " << userNameLength << std::endl;
-                    std::cout << "User Name: " << userName << std::endl;
+                // The slot is decided and taken in memory now; the reply waits for the insert to commit
+                auto [bookingStatus, bookingPosition] = fac.addBooking(startDay, startHour, startMinute, endDay, endHour, endMinute, userName);
+                std::cout << "Booking Status: " << bookingStatus << std::endl;
+                facility* bookingFacility = &fac;
+                size_t position = bookingPosition;
+                auto bookingReply = [](int status, const std::string& result) {
+                    std::vector<unsigned char> data;
+                    data.push_back((unsigned char) status);
+                    uint32_t bookingResultLength = htonl(result.size());
+                    data.insert(data.end(), (unsigned char*)&bookingResultLength, (unsigned char*)&bookingResultLength + sizeof(bookingResultLength));
+                    data.insert(data.end(), result.begin(), result.end());
+                    return data;
+                };
+                if (bookingStatus != 0) {
+                    // Failed attempts go to the audit log, not the booking table
+                    auditLog.record(fac.facilityId, userName, startDay, startHour, startMinute, endDay, endHour, endMinute, auditConflict);
+                    auto [total_length, replyBuffer] = msg.createReply(bookingReply(bookingStatus, "Booking conflict detected!"));
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
+                    break;
+                }
+                bool tookTicket = suspend(msg, clientKey);
+                sockaddr_in address = clientAddress;
+                std::string key = clientKey;
+                fac.pendingWrites++;
+                db.execute(INSERT_BOOKING_SQL, retention.insertParams(fac.booking(position)), [this, msg, key, address, tookTicket, bookingFacility, position, bookingReply](bool ok, const std::string& bookingID) mutable {
+                    bookingFacility->pendingWrites--;
+                    if (ok && !bookingID.empty()) {
+                        std::cout << "Booking saved with ID " << bookingID << std::endl;
+                        bookingFacility->confirmBooking(position, bookingID);
+                        resume(msg, key, address, tookTicket, bookingReply(0, bookingID), 0);
+                    } else {
+                        std::cerr << "Failed to save booking" << std::endl;
+                        Booking attempt = bookingFacility->booking(position);
+                        auditLog.record(attempt.facilityId, attempt.userName, attempt.bookingStartDay, attempt.bookingStartHour, attempt.bookingStartMinute,
+                                        attempt.bookingEndDay, attempt.bookingEndHour, attempt.bookingEndMinute, auditNotSaved);
+                        bookingFacility->rejectBooking(position);
+                        resume(msg, key, address, tookTicket, bookingReply(1, "Booking could not be saved"), 0, false);
+                    }
+                });
+                break;
+            }
+            case 3: {
+                int offset = 0;
+                uint32_t userNameLength;
+                memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
+                userNameLength = ntohl(userNameLength);
+                offset += sizeof(userNameLength);
+                std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
+                offset += userNameLength;
+                std::cout << "User Name Length: " << userNameLength << std::endl;
+                std::cout << "User Name: " << userName << std::endl;
 
-                    uint32_t confirmationId;
-                    memcpy(&confirmationId, msg.msg.messageData.data() + offset, sizeof(confirmationId));
-                    confirmationId = ntohl(confirmationId);
-                    std::cout << "Confirmation ID: " << (int)confirmationId << std::endl;
-                    offset += sizeof(confirmationId);
+                uint32_t confirmationId;
+                memcpy(&confirmationId, msg.msg.messageData.data() + offset, sizeof(confirmationId));
+                confirmationId = ntohl(confirmationId);
+                std::cout << "Confirmation ID: " << (int)confirmationId << std::endl;
+                offset += sizeof(confirmationId);
 
-                    Booking retrievedBooking = Booking(confirmationId);
-                    std::cout << "Booking ID: " << retrievedBooking.bookingID << std::endl;
-                    std::cout << "Facility ID: " << retrievedBooking.facilityId << std::endl;
+                // Bookings made through this server are resident; anything else is loaded from the database
+                std::optional<Booking> indexedBooking = facilities.findBooking(std::to_string(confirmationId));
+                Booking retrievedBooking = indexedBooking.has_value() ? *indexedBooking : Booking(confirmationId);
+                std::cout << "Booking ID: " << retrievedBooking.bookingID << std::endl;
+                std::cout << "Facility ID: " << retrievedBooking.facilityId << std::endl;
 
-                    if (userName != retrievedBooking.userName) {
-                        std::cerr << "User name does not match" << std::endl;
-                        std::vector<unsigned char> data;
-                        // data.push_back((unsigned char) 3);
-                        auto [total_length, replyBuffer] = msg.createReply(data, 3);
-                        sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
-                        break;
-                    }
+                if (userName != retrievedBooking.userName) {
+                    std::cerr << "User name does not match" << std::endl;
+                    std::vector<unsigned char> data;
+                    // data.push_back((unsigned char) 3);
+                    auto [total_length, replyBuffer] = msg.createReply(data, 3);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    break;
+                }
 
-                    uint8_t preponeOrPostpone;
-                    memcpy(&preponeOrPostpone, msg.msg.messageData.data() + offset, sizeof(preponeOrPostpone));
-                    std::cout << "Prepone or Postpone: " << (int)preponeOrPostpone << std::endl;
-                    offset += sizeof(preponeOrPostpone);
+                uint8_t preponeOrPostpone;
+                memcpy(&preponeOrPostpone, msg.msg.messageData.data() + offset, sizeof(preponeOrPostpone));
+                std::cout << "Prepone or Postpone: " << (int)preponeOrPostpone << std::endl;
+                offset += sizeof(preponeOrPostpone);
 
-                    uint32_t shiftMinutes;
-                    memcpy(&shiftMinutes, msg.msg.messageData.data() + offset, sizeof(shiftMinutes));
-                    shiftMinutes = ntohl(shiftMinutes);
-                    std::cout << "Shift Minutes: " << shiftMinutes << std::endl;
-                    offset += sizeof(shiftMinutes);
-                    int change;
-                    if (preponeOrPostpone == POSTPONE) {
-                        change = (int)shiftMinutes;
-                    }
-                    else {
-                        change = (int)-shiftMinutes;
-                    }
-                    std::cout << "Change: " << change << std::endl;
+                uint32_t shiftMinutes;
+                memcpy(&shiftMinutes, msg.msg.messageData.data() + offset, sizeof(shiftMinutes));
+                shiftMinutes = ntohl(shiftMinutes);
+                std::cout << "Shift Minutes: " << shiftMinutes << std::endl;
+                offset += sizeof(shiftMinutes);
+                int change;
+                if (preponeOrPostpone == POSTPONE) {
+                    change = (int)shiftMinutes;
+                }
+                else {
+                    change = (int)-shiftMinutes;
+                }
+                std::cout << "Change: " << change << std::endl;
 
-                    int changeStatus = retrievedBooking.changeBookingMinutes(change);
-                    std::cout << "Change Status: " << changeStatus << std::endl;
+                auto bookingTimes = [](const Booking& booking) {
                     std::vector<unsigned char> data;
-                    data.push_back((unsigned char)retrievedBooking.bookingStartDay);
-                    data.push_back((unsigned char)retrievedBooking.bookingStartHour);
-                    data.push_back((unsigned char)retrievedBooking.bookingStartMinute);
-                    data.push_back((unsigned char)retrievedBooking.bookingEndDay);
-                    data.push_back((unsigned char)retrievedBooking.bookingEndHour);
-                    data.push_back((unsigned char)retrievedBooking.bookingEndMinute);
-
-                    auto [totallength, buffer] = msg.createReply(data, changeStatus);
-                    std::unordered_map<uint32_t, std::string> responseMap;
-                    responseMap[msg.msg.requestID] = std::string(buffer, totallength);
-                    prevRequestData.emplace(ipStr, responseMap);
-                    sendto(socket_fd, buffer, totallength, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
+                    data.push_back((unsigned char)booking.bookingStartDay);
+                    data.push_back((unsigned char)booking.bookingStartHour);
+                    data.push_back((unsigned char)booking.bookingStartMinute);
+                    data.push_back((unsigned char)booking.bookingEndDay);
+                    data.push_back((unsigned char)booking.bookingEndHour);
+                    data.push_back((unsigned char)booking.bookingEndMinute);
+                    return data;
+                };
+                Booking originalBooking = retrievedBooking;
+                int changeStatus = retrievedBooking.shiftBookingMinutes(change);
+                std::cout << "Change Status: " << changeStatus << std::endl;
+                if (changeStatus != 0) {
+                    auto [totallength, buffer] = msg.createReply(bookingTimes(retrievedBooking), changeStatus);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(buffer, totallength);
+                    sendReply(clientAddress, buffer, totallength);
                     std::cout << "Reply sent" << std::endl;
                     break;
                 }
+                // Memory moves first so availability reflects the change while the update is in flight
+                bool resident = indexedBooking.has_value();
+                facility* bookingFacility = nullptr;
+                if (resident) {
+                    bookingFacility = bookingIndex.bookingsById.at(confirmationId).fac;
+                    bookingFacility->pendingModifies++;
+                    facilities.updateBooking(retrievedBooking);
+                }
+                tokenIndex.updateBooking(retrievedBooking);
+                bool tookTicket = suspend(msg, clientKey);
+                sockaddr_in address = clientAddress;
+                std::string key = clientKey;
+                std::vector<unsigned char> data = bookingTimes(retrievedBooking);
+                std::vector<unsigned char> originalData = bookingTimes(originalBooking);
+                db.execute(UPDATE_BOOKING_SQL, retrievedBooking.databaseParams(), [this, msg, key, address, tookTicket, resident, bookingFacility, originalBooking, data, originalData](bool ok, const std::string& bookingID) mutable {
+                    if (bookingFacility != nullptr) {
+                        bookingFacility->pendingModifies--;
+                    }
+                    if (ok && !bookingID.empty()) {
+                        resume(msg, key, address, tookTicket, data, 0);
+                    } else {
+                        std::cerr << "Failed to save booking change" << std::endl;
+                        if (resident) {
+                            facilities.updateBooking(originalBooking);
+                        }
+                        tokenIndex.updateBooking(originalBooking);
+                        resume(msg, key, address, tookTicket, originalData, 1, false);
+                    }
+                    std::cout << "Reply sent" << std::endl;
+                });
+                break;
+            }
 
-                case 4: {
-                    int offset = 0;
-                    memcpy(&facilityNameLength, msg.msg.messageData.data(), sizeof(facilityNameLength));
-                    facilityNameLength = ntohl(facilityNameLength);
-                    offset += sizeof(facilityNameLength);
-                    facilityName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(facilityNameLength));
-                    offset += facilityNameLength;
-                    std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
-                    std::cout << "Facility Name: " << facilityName << std::endl;
+            case 4: {
+                int offset = 0;
+                memcpy(&facilityNameLength, msg.msg.messageData.data(), sizeof(facilityNameLength));
+                facilityNameLength = ntohl(facilityNameLength);
+                offset += sizeof(facilityNameLength);
+                facilityName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(facilityNameLength));
+                offset += facilityNameLength;
+                std::cout << "Facility Name Length: " << facilityNameLength << std::endl;
+                std::cout << "Facility Name: " << facilityName << std::endl;
 
-                    uint32_t durationToWatch;
-                    memcpy(&durationToWatch, msg.msg.messageData.data() + offset, sizeof(durationToWatch));
-                    durationToWatch = ntohl(durationToWatch);
-                    std::cout << "Duration to watch: " << durationToWatch << std::endl;
+                uint32_t durationToWatch;
+                memcpy(&durationToWatch, msg.msg.messageData.data() + offset, sizeof(durationToWatch));
+                durationToWatch = ntohl(durationToWatch);
+                offset += sizeof(durationToWatch);
+                std::cout << "Duration to watch: " << durationToWatch << std::endl;
+                // Optional delivery mode; without it changes are coalesced into binary deltas
+                MonitorDelivery delivery = deliverCoalesced;
+                if (msg.msg.messageData.size() > (size_t)offset && msg.msg.messageData[offset] == deliverPerEvent) {
+                    delivery = deliverPerEvent;
+                }
+                std::cout << "Delivery: " << (int)delivery << std::endl;
 
-                    facility fac(facilityName);
+                facility& fac = facilities.get(facilityName);
 
-                    clients.emplace(fac.facilityName, MonitorClients{socket_fd, clientAddress, clientAddressLength , std::chrono::steady_clock::now() + std::chrono::minutes(durationToWatch), msg});
-                    
-                    std::string message = "Monitoring started for facility " + fac.facilityName + " for " + std::to_string(durationToWatch) + " minutes";
-                    std::vector<unsigned char> data;
-                    data.push_back((unsigned char)message.size());
-                    data.insert(data.end(), message.begin(), message.end());
-                    auto [totallength, replybuffer] = msg.createReply(data);
-                    std::cout << "Sending notification to client" << std::endl;
-                    std::unordered_map<uint32_t, std::string> responseMap;
-                    responseMap[msg.msg.requestID] = std::string(replybuffer, totallength);
-                    prevRequestData.emplace(ipStr, responseMap);
-                    sendto(socket_fd, replybuffer, totallength, 0,
-                           (struct sockaddr *)&clientAddress, clientAddressLength);
-                    std::cout << "Reply sent" << std::endl;
-                }
-                case 5: {
-                    int offset = 0;
-                    uint32_t userNameLength;
-                    memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
+                monitors.subscribe(fac.facilityName, MonitorClients{socket_fd, clientAddress, clientAddressLength , std::chrono::steady_clock::now() + std::chrono::minutes(durationToWatch), msg, delivery});
+                
+                std::string message = "Monitoring started for facility " + fac.facilityName + " for " + std::to_string(durationToWatch) + " minutes";
+                std::vector<unsigned char> data;
+                data.push_back((unsigned char)message.size());
+                data.insert(data.end(), message.begin(), message.end());
+                auto [totallength, replybuffer] = msg.createReply(data);
+                std::cout << "Sending notification to client" << std::endl;
+                prevRequestData[clientKey][msg.msg.requestID] = std::string(replybuffer, totallength);
+                sendReply(clientAddress, replybuffer, totallength);
+                std::cout << "Reply sent" << std::endl;
+                break;
+            }
+            case 5: {
+                int offset = 0;
+                const std::vector<unsigned char>& payload = msg.msg.messageData;
+                uint32_t userNameLength = 0;
+                std::string userName;
+                bool validRequest = payload.size() >= sizeof(userNameLength);
+                if (validRequest) {
+                    memcpy(&userNameLength, payload.data(), sizeof(userNameLength));
                     userNameLength = ntohl(userNameLength);
                     offset += sizeof(userNameLength);
-                    std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
+                    validRequest = payload.size() >= (size_t)offset + userNameLength;
+                }
+                if (validRequest) {
+                    userName = std::string((char*)payload.data() + offset, static_cast<size_t>(userNameLength));
                     offset += userNameLength;
                     std::cout << "User Name Length: " << userNameLength << std::endl;
                     std::cout << "User Name: " << userName << std::endl;
-                    
+                }
 
-                    pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
-                    if (conn.is_open()) {
-                        std::cout << "Connected to database" << std::endl;
-                    } else {
-                        std::cerr << "Failed to connect to database" << std::endl;
-                        return;
+                // Optional filters follow the username: a flag byte, then the facility name,
+                // the inclusive day range and the booking status for each flag that is set
+                uint8_t filterFlags = 0;
+                std::string filterFacility;
+                uint8_t filterStartDay = 0, filterEndDay = 6, filterStatus = 0;
+                if (validRequest && payload.size() > (size_t)offset) {
+                    filterFlags = payload[offset];
+                    offset += sizeof(filterFlags);
+                    if (filterFlags & USER_FILTER_FACILITY) {
+                        validRequest = payload.size() >= (size_t)offset + sizeof(facilityNameLength);
+                        if (validRequest) {
+                            memcpy(&facilityNameLength, payload.data() + offset, sizeof(facilityNameLength));
+                            facilityNameLength = ntohl(facilityNameLength);
+                            offset += sizeof(facilityNameLength);
+                            validRequest = payload.size() >= (size_t)offset + facilityNameLength;
+                        }
+                        if (validRequest) {
+                            filterFacility = std::string((char*)payload.data() + offset, static_cast<size_t>(facilityNameLength));
+                            offset += facilityNameLength;
+                        }
+                    }
+                    if (validRequest && (filterFlags & USER_FILTER_DAYS)) {
+                        validRequest = payload.size() >= (size_t)offset + 2;
+                        if (validRequest) {
+                            filterStartDay = payload[offset];
+                            filterEndDay = payload[offset + 1];
+                            offset += 2;
+                        }
                     }
-                    pqxx::work txn(conn);
-                    std::string query = "SELECT * FROM booking b, facility f where b.facility_id = f.facility_id and b.username = '" + userName + "';";
-                    std::cout << "Query: " << query << std::endl;
-                    pqxx::result res = txn.exec(query);
-                    
+                    if (validRequest && (filterFlags & USER_FILTER_STATUS)) {
+                        validRequest = payload.size() >= (size_t)offset + sizeof(filterStatus);
+                        if (validRequest) {
+                            filterStatus = payload[offset];
+                            offset += sizeof(filterStatus);
+                        }
+                    }
+                }
+                if (!validRequest) {
+                    // Malformed requests get an empty list with status 1
+                    std::cerr << "Invalid view bookings request" << std::endl;
+                    std::vector<unsigned char> data = {0};
+                    auto [total_length, replyBuffer] = msg.createReply(data, 1);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
+                    break;
+                }
+                std::cout << "Filter Flags: " << (int)filterFlags << std::endl;
+
+                std::vector<unsigned char> data;
+                // Booking count (assumes not more than 255 bookings)
+                data.push_back(0);
+                size_t bookingCount = 0;
+
+                // Bookings still waiting on the database have no ID yet and are left out; ones the
+                // database refused are only listed when the client asks for failed bookings
+                bool wantsFailed = (filterFlags & USER_FILTER_STATUS) && filterStatus == failed;
+                uint32_t user;
+                auto found = userNames.find(userName, user) ? bookingIndex.bookingsByUser.find(user) : bookingIndex.bookingsByUser.end();
+                if (found != bookingIndex.bookingsByUser.end()) {
+                    for (const BookingRef& ref : found->second) {
+                        const BookingStore& store = ref.fac->bookings;
+                        if (store.status(ref.index) == failed ? !wantsFailed : store.ids[ref.index] == NO_BOOKING_ID) {
+                            continue;
+                        }
+                        WeekMinute start = store.starts[ref.index];
+                        WeekMinute end = store.ends[ref.index];
+                        if ((filterFlags & USER_FILTER_FACILITY) && ref.fac->facilityName != filterFacility) {
+                            continue;
+                        }
+                        if ((filterFlags & USER_FILTER_DAYS) && (weekDay(start) < filterStartDay || weekDay(start) > filterEndDay)) {
+                            continue;
+                        }
+                        if ((filterFlags & USER_FILTER_STATUS) && store.status(ref.index) != filterStatus) {
+                            continue;
+                        }
+                        data.push_back((unsigned char)weekDay(start));
+                        data.push_back((unsigned char)weekHour(start));
+                        data.push_back((unsigned char)weekMinute(start));
+                        data.push_back((unsigned char)weekHour(end));
+                        data.push_back((unsigned char)weekMinute(end));
+
+                        std::string bookingID = bookingIdString(store.ids[ref.index]);
+                        data.push_back((unsigned char)bookingID.size());
+                        data.insert(data.end(), bookingID.begin(), bookingID.end());
+
+                        const std::string& bookingFacilityName = ref.fac->facilityName;
+                        data.push_back((unsigned char)bookingFacilityName.size());
+                        data.insert(data.end(), bookingFacilityName.begin(), bookingFacilityName.end());
+                        bookingCount++;
+                    }
+                }
+                data[0] = (unsigned char)bookingCount;
+                std::cout << "Number of bookings: " << bookingCount << std::endl;
+
+                // Package + send reply
+                auto [total_length, replyBuffer] = msg.createReply(data);
+                prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                sendReply(clientAddress, replyBuffer, total_length);
+                break;
+            }
+
+            case 6: {
+                int offset = 0;
+                uint32_t userNameLength;
+                memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
+                userNameLength = ntohl(userNameLength);
+                offset += sizeof(userNameLength);
+                std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
+                offset += userNameLength;
+                std::cout << "User Name Length: " << userNameLength << std::endl;
+                std::cout << "User Name: " << userName << std::endl;
+
+                uint32_t confirmationId;
+                memcpy(&confirmationId, msg.msg.messageData.data() + offset, sizeof(confirmationId));
+                confirmationId = ntohl(confirmationId);
+                std::cout << "Confirmation ID: " << (int)confirmationId << std::endl;
+                offset += sizeof(confirmationId);
+
+                // A live token already in the index answers the request without a database round trip
+                AccessToken existingToken;
+                if (tokenIndex.findByBooking(std::to_string(confirmationId), existingToken) && existingToken.userName == userName) {
+                    std::cerr << "Access code already exists" << std::endl;
                     std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, 1);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    break;
+                }
 
-                    // Booking count (assumes not more than 255 bookings)
-                    data.push_back((unsigned char)res.size());
-                    std::cout << "Number of bookings: " << res.size() << std::endl;
-                    
-                    for (const auto& row : res) {
-                        // Extract time info
-                        unsigned char day      = (unsigned char)row["start_day"].as<int>();
-                        unsigned char shour    = (unsigned char)row["start_hour"].as<int>();
-                        unsigned char sminute  = (unsigned char)row["start_minute"].as<int>();
-                        unsigned char ehour    = (unsigned char)row["end_hour"].as<int>();
-                        unsigned char eminute  = (unsigned char)row["end_minute"].as<int>();
-                    
-                        data.push_back(day);
-                        data.push_back(shour);
-                        data.push_back(sminute);
-                        data.push_back(ehour);
-                        data.push_back(eminute);
-                        
-                        std::string bookingId = row["booking_id"].as<std::string>();
-                        data.push_back((unsigned char)bookingId.size());
-                        std::cout << "Booking ID Length: " << bookingId.size() << std::endl;
-                        data.insert(data.end(), bookingId.begin(), bookingId.end());
-                        std::cout << "Booking ID: " << bookingId << std::endl;
-                        
-                        std::string facilityName = row["facility_name"].as<std::string>();
-                        data.push_back((unsigned char)facilityName.size());
-                        data.insert(data.end(), facilityName.begin(), facilityName.end());
-                        std::cout << "Facility Name: " << facilityName << std::endl; 
-                    }
-                    
-                    // Package + send reply
-                    auto [total_length, replyBuffer] = msg.createReply(data);
-                    std::unordered_map<uint32_t, std::string> responseMap;
-                    responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);
-                    prevRequestData.emplace(ipStr, responseMap);
-                    sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
+                uint32_t code;
+                if (!tokenIndex.generateUniqueCode(code)) {
+                    std::cerr << "No free access code available" << std::endl;
+                    std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, 4);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
                     break;
                 }
+                std::string randomCode = formatCode(code);
 
-                case 6: {
-                    int offset = 0;
-                    uint32_t userNameLength;
-                    memcpy(&userNameLength, msg.msg.messageData.data(), sizeof(userNameLength));
+                // Ownership lookup, removal of expired codes and a conditional insert go out together and
+                // share one round trip. Expired rows holding the drawn code or belonging to this booking
+                // are deleted; the insert only happens if the user owns the booking and it has no live code.
+                auto details = std::make_shared<AccessToken>();
+                auto owned = std::make_shared<bool>(false);
+                auto live = std::make_shared<bool>(false);
+                auto inserted = std::make_shared<bool>(false);
+                db.send(
+                    "SELECT b.booking_id, f.facility_name, b.start_day, b.start_hour, b.start_minute, b.end_day, b.end_hour, b.end_minute, "
+                    "EXISTS (SELECT 1 FROM access a WHERE a.booking_id = b.booking_id AND a.issued_at > now() - make_interval(secs => $3::int8)) "
+                    "FROM booking b JOIN facility f ON b.facility_id = f.facility_id "
+                    "WHERE b.booking_id = $1 AND b.username = $2",
+                    {std::to_string(confirmationId), userName, TOKEN_LIFETIME_SECONDS},
+                    [details, owned, live, userName](PGresult* res) {
+                        if (res == nullptr || PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+                            return;
+                        }
+                        *owned = true;
+                        *live = std::string(PQgetvalue(res, 0, 8)) == "t";
+                        details->bookingID = PQgetvalue(res, 0, 0);
+                        details->facilityName = PQgetvalue(res, 0, 1);
+                        details->userName = userName;
+                        details->bookingStartDay = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 2)));
+                        details->bookingStartHour = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 3)));
+                        details->bookingStartMinute = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 4)));
+                        details->bookingEndDay = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 5)));
+                        details->bookingEndHour = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 6)));
+                        details->bookingEndMinute = static_cast<uint>(std::stoi(PQgetvalue(res, 0, 7)));
+                    }
+                );
+                db.send(DELETE_REPLACED_ACCESS_SQL, {randomCode, std::to_string(confirmationId), TOKEN_LIFETIME_SECONDS}, [](PGresult*) {});
+                db.send(
+                    "INSERT INTO access (booking_id, access_code, issued_at) "
+                    "SELECT b.booking_id, $3, now() FROM booking b "
+                    "WHERE b.booking_id = $1 AND b.username = $2 "
+                    "AND NOT EXISTS (SELECT 1 FROM access a WHERE a.booking_id = b.booking_id OR a.access_code = $3) "
+                    "RETURNING access_code",
+                    {std::to_string(confirmationId), userName, randomCode},
+                    [inserted](PGresult* res) {
+                        *inserted = res != nullptr && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0;
+                    }
+                );
+                bool tookTicket = suspend(msg, clientKey);
+                sockaddr_in address = clientAddress;
+                std::string key = clientKey;
+                db.sync([this, msg, key, address, tookTicket, code, randomCode, details, owned, live, inserted](bool ok) mutable {
+                    std::vector<unsigned char> data;
+                    if (!ok) {
+                        std::cerr << "Failed to issue access code" << std::endl;
+                        tokenIndex.release(code);
+                        resume(msg, key, address, tookTicket, data, 4, false);
+                    } else if (!*owned) {
+                        std::cerr << "Not the user" << std::endl;
+                        tokenIndex.release(code);
+                        resume(msg, key, address, tookTicket, data, 2);
+                    } else if (*live) {
+                        std::cerr << "Access code already exists" << std::endl;
+                        tokenIndex.release(code);
+                        resume(msg, key, address, tookTicket, data, 1);
+                    } else if (!*inserted) {
+                        // The drawn code is held by a live row the index did not know about; the client may retry
+                        std::cerr << "Access code taken in the database" << std::endl;
+                        tokenIndex.release(code);
+                        resume(msg, key, address, tookTicket, data, 4, false);
+                    } else {
+                        std::cout << "Access code generated and saved to database" << std::endl;
+                        details->expires = std::chrono::system_clock::now() + TOKEN_LIFETIME;
+                        tokenIndex.insert(code, *details);
+                        data.push_back((unsigned char)randomCode.size());
+                        data.insert(data.end(), randomCode.begin(), randomCode.end());
+                        std::cout << "Access Code: " << randomCode << std::endl;
+                        resume(msg, key, address, tookTicket, data, 0);
+                    }
+                });
+                break;
+            }
+
+            case 7: {
+                // Verify an access token at the facility door, answered from memory only
+                int offset = 0;
+                const std::vector<unsigned char>& payload = msg.msg.messageData;
+                uint32_t codeLength = 0;
+                bool validRequest = payload.size() >= sizeof(codeLength);
+                if (validRequest) {
+                    memcpy(&codeLength, payload.data(), sizeof(codeLength));
+                    codeLength = ntohl(codeLength);
+                    offset += sizeof(codeLength);
+                    validRequest = payload.size() >= (size_t)offset + codeLength;
+                }
+                std::string accessCode;
+                if (validRequest) {
+                    accessCode = std::string((char*)payload.data() + offset, static_cast<size_t>(codeLength));
+                    offset += codeLength;
+                }
+                // Facility name is optional; scanners send it to reject tokens for other facilities
+                if (validRequest && payload.size() >= (size_t)offset + sizeof(facilityNameLength)) {
+                    memcpy(&facilityNameLength, payload.data() + offset, sizeof(facilityNameLength));
+                    facilityNameLength = ntohl(facilityNameLength);
+                    offset += sizeof(facilityNameLength);
+                    validRequest = payload.size() >= (size_t)offset + facilityNameLength;
+                    if (validRequest) {
+                        facilityName = std::string((char*)payload.data() + offset, static_cast<size_t>(facilityNameLength));
+                    }
+                }
+                if (!validRequest) {
+                    // Malformed scanner packets are answered as an unknown code
+                    std::cerr << "Invalid verify request" << std::endl;
+                    std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, tokenUnknown);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
+                    break;
+                }
+                std::cout << "Access Code: " << accessCode << std::endl;
+                std::cout << "Facility Name: " << facilityName << std::endl;
+
+                AccessToken token;
+                TokenVerifyStatus verifyStatus = tokenIndex.verify(accessCode, facilityName, token);
+                std::cout << "Verify Status: " << verifyStatus << std::endl;
+                std::vector<unsigned char> data;
+                if (verifyStatus == tokenValid) {
+                    data.push_back((unsigned char)token.bookingID.size());
+                    data.insert(data.end(), token.bookingID.begin(), token.bookingID.end());
+                    data.push_back((unsigned char)token.bookingStartDay);
+                    data.push_back((unsigned char)token.bookingStartHour);
+                    data.push_back((unsigned char)token.bookingStartMinute);
+                    data.push_back((unsigned char)token.bookingEndDay);
+                    data.push_back((unsigned char)token.bookingEndHour);
+                    data.push_back((unsigned char)token.bookingEndMinute);
+                    data.push_back((unsigned char)token.userName.size());
+                    data.insert(data.end(), token.userName.begin(), token.userName.end());
+                }
+                // Verification is idempotent and bursty, so replies are not kept in prevRequestData
+                auto [total_length, replyBuffer] = msg.createReply(data, verifyStatus);
+                sendReply(clientAddress, replyBuffer, total_length);
+                delete[] replyBuffer;
+                break;
+            }
+
+            case 8: {
+                // Bulk booking: an explicit list of slots or a weekly recurrence rule
+                int offset = 0;
+                const std::vector<unsigned char>& payload = msg.msg.messageData;
+                uint32_t userNameLength = 0;
+                std::string userName;
+                bool validRequest = payload.size() >= sizeof(userNameLength);
+                if (validRequest) {
+                    memcpy(&userNameLength, payload.data(), sizeof(userNameLength));
                     userNameLength = ntohl(userNameLength);
                     offset += sizeof(userNameLength);
-                    std::string userName = std::string((char*)msg.msg.messageData.data() + offset, static_cast<size_t>(userNameLength));
+                    validRequest = payload.size() >= (size_t)offset + userNameLength + sizeof(facilityNameLength);
+                }
+                if (validRequest) {
+                    userName = std::string((char*)payload.data() + offset, static_cast<size_t>(userNameLength));
                     offset += userNameLength;
-                    std::cout << "User Name Length: " << userNameLength << std::endl;
                     std::cout << "User Name: " << userName << std::endl;
+                    memcpy(&facilityNameLength, payload.data() + offset, sizeof(facilityNameLength));
+                    facilityNameLength = ntohl(facilityNameLength);
+                    offset += sizeof(facilityNameLength);
+                    // Mode and slot kind follow the name
+                    validRequest = payload.size() >= (size_t)offset + facilityNameLength + 2;
+                }
+                if (!validRequest) {
+                    std::cerr << "Invalid bulk booking request" << std::endl;
+                    std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, 3);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
+                    break;
+                }
+                facilityName = std::string((char*)payload.data() + offset, static_cast<size_t>(facilityNameLength));
+                offset += facilityNameLength;
+                std::cout << "Facility Name: " << facilityName << std::endl;
 
-                    uint32_t confirmationId;
-                    memcpy(&confirmationId, msg.msg.messageData.data() + offset, sizeof(confirmationId));
-                    confirmationId = ntohl(confirmationId);
-                    std::cout << "Confirmation ID: " << (int)confirmationId << std::endl;
-                    offset += sizeof(confirmationId);
+                uint8_t bulkMode = payload[offset];
+                uint8_t slotKind = payload[offset + 1];
+                offset += 2;
+                std::cout << "Bulk Mode: " << (int)bulkMode << std::endl;
+                std::cout << "Slot Kind: " << (int)slotKind << std::endl;
 
-                    pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
-                    if (conn.is_open()) {
-                        std::cout << "Connected to database" << std::endl;
-                    } else {
-                        std::cerr << "Failed to connect to database" << std::endl;
-                        return;
+                facility& fac = facilities.get(facilityName);
+                std::vector<Booking> candidates;
+                if (slotKind == SLOTS_EXPLICIT) {
+                    validRequest = payload.size() >= (size_t)offset + 1;
+                    uint8_t slotCount = validRequest ? payload[offset] : 0;
+                    offset += sizeof(slotCount);
+                    validRequest = validRequest && payload.size() >= (size_t)offset + slotCount * 6;
+                    for (int i = 0; validRequest && i < slotCount; i++) {
+                        const unsigned char* slot = payload.data() + offset + i * 6;
+                        candidates.emplace_back(fac.facilityId, slot[0], slot[1], slot[2], slot[3], slot[4], slot[5], userName);
+                    }
+                } else if (slotKind == SLOTS_RECURRING) {
+                    // Day mask, first start and end time, how many times to repeat per day and the minutes between repeats
+                    validRequest = payload.size() >= (size_t)offset + 8;
+                    if (validRequest) {
+                        uint8_t dayMask = payload[offset];
+                        uint start = payload[offset + 1] * 60 + payload[offset + 2];
+                        uint end = payload[offset + 3] * 60 + payload[offset + 4];
+                        uint8_t repeatCount = payload[offset + 5];
+                        uint16_t repeatInterval;
+                        memcpy(&repeatInterval, payload.data() + offset + 6, sizeof(repeatInterval));
+                        repeatInterval = ntohs(repeatInterval);
+                        for (uint day = 0; day < 7; day++) {
+                            if (!(dayMask & (1 << day))) {
+                                continue;
+                            }
+                            for (uint i = 0; i < repeatCount; i++) {
+                                uint slotStart = start + i * repeatInterval;
+                                uint slotEnd = end + i * repeatInterval;
+                                candidates.emplace_back(fac.facilityId, day, slotStart / 60, slotStart % 60, day, slotEnd / 60, slotEnd % 60, userName);
+                            }
+                        }
+                    }
+                } else {
+                    validRequest = false;
+                }
+                if (!validRequest || candidates.empty() || candidates.size() > 255) {
+                    std::cerr << "Invalid bulk booking request" << std::endl;
+                    std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, 3);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    break;
+                }
+
+                // Slots with impossible times are reported individually and never reach the conflict check
+                std::vector<Booking> valid;
+                std::vector<size_t> validPositions;
+                std::vector<uint8_t> outcomes(candidates.size(), slotInvalid);
+                for (size_t i = 0; i < candidates.size(); i++) {
+                    const Booking& candidate = candidates[i];
+                    uint start = candidate.bookingStartHour * 60 + candidate.bookingStartMinute;
+                    uint end = candidate.bookingEndHour * 60 + candidate.bookingEndMinute;
+                    if (candidate.bookingStartDay < 7 && candidate.bookingEndDay == candidate.bookingStartDay &&
+                        candidate.bookingEndHour < 24 && candidate.bookingStartMinute < 60 && candidate.bookingEndMinute < 60 && start < end) {
+                        valid.push_back(candidate);
+                        validPositions.push_back(i);
+                    }
+                }
+                bool allOrNothing = bulkMode == BULK_ALL_OR_NOTHING;
+                std::vector<size_t> accepted;
+                if (allOrNothing && valid.size() != candidates.size()) {
+                    for (size_t position : validPositions) {
+                        outcomes[position] = slotNotCommitted;
                     }
-                    pqxx::work txn(conn);
-                    std::string query = "SELECT 1 FROM booking WHERE booking_id = '" + std::to_string(confirmationId) + "' and username = '" + userName + "';";
-                    std::cout << "Query: " << query << std::endl;
-                    pqxx::result res = txn.exec(query);
-                    if (res.size() > 0) {
-                        std::string query = "SELECT 1 FROM access WHERE booking_id = '" + std::to_string(confirmationId) + "';";
-                        std::cout << "Query: " << query << std::endl;
-                        pqxx::result res = txn.exec(query);
-                        if (res.size() == 0) {
-                            std::string randomCode = generate6DigitCode();
-                            res = txn.exec(
-                                "INSERT INTO access (booking_id, access_code) VALUES ($1, $2)",
-                                pqxx::params(
-                                    std::to_string(confirmationId),
-                                    randomCode
-                                )
-                            );
-                            txn.commit();
-                            std::cout << "Access code generated and saved to database" << std::endl;
-                            std::cout << "Query: " << query << std::endl;
-                            
-                            std::vector<unsigned char> data;
-                            data.push_back((unsigned char)randomCode.size());
-                            data.insert(data.end(), randomCode.begin(), randomCode.end());
-                            std::cout << "Access Code: " << randomCode << std::endl;
-                            auto [total_length, replyBuffer] = msg.createReply(data);
-                            std::unordered_map<uint32_t, std::string> responseMap;
-                            responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);;
-                            prevRequestData.emplace(ipStr, responseMap);
-                            sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
-                            break;
+                } else {
+                    std::vector<uint8_t> validOutcomes = fac.addBookings(valid, allOrNothing, accepted);
+                    for (size_t i = 0; i < valid.size(); i++) {
+                        outcomes[validPositions[i]] = validOutcomes[i];
+                        candidates[validPositions[i]] = valid[i];
+                    }
+                }
+                for (size_t i = 0; i < candidates.size(); i++) {
+                    if (outcomes[i] == slotConflict || outcomes[i] == slotConflictInBatch) {
+                        const Booking& candidate = candidates[i];
+                        auditLog.record(fac.facilityId, userName, candidate.bookingStartDay, candidate.bookingStartHour, candidate.bookingStartMinute,
+                                        candidate.bookingEndDay, candidate.bookingEndHour, candidate.bookingEndMinute, auditConflict);
+                    }
+                }
+
+                auto bulkReply = [](const std::vector<Booking>& candidates, const std::vector<uint8_t>& outcomes, const std::vector<std::string>& bookingIDs) {
+                    size_t bookedCount = 0;
+                    std::vector<unsigned char> data;
+                    data.push_back((unsigned char)candidates.size());
+                    for (size_t i = 0; i < candidates.size(); i++) {
+                        const Booking& candidate = candidates[i];
+                        data.push_back((unsigned char)candidate.bookingStartDay);
+                        data.push_back((unsigned char)candidate.bookingStartHour);
+                        data.push_back((unsigned char)candidate.bookingStartMinute);
+                        data.push_back((unsigned char)candidate.bookingEndDay);
+                        data.push_back((unsigned char)candidate.bookingEndHour);
+                        data.push_back((unsigned char)candidate.bookingEndMinute);
+                        data.push_back(outcomes[i]);
+                        std::string bookingID = outcomes[i] == slotBooked ? bookingIDs[i] : "";
+                        data.push_back((unsigned char)bookingID.size());
+                        data.insert(data.end(), bookingID.begin(), bookingID.end());
+                        if (outcomes[i] == slotBooked) {
+                            bookedCount++;
                         }
-                        else{
-                            std::cerr << "Access code already exists" << std::endl;
-                            std::vector<unsigned char> data;
-                            auto [total_length, replyBuffer] = msg.createReply(data, 1);
-                            std::unordered_map<uint32_t, std::string> responseMap;
-                            responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);
-                            prevRequestData.emplace(ipStr, responseMap);
-                            sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
+                    }
+                    std::cout << "Booked " << bookedCount << " of " << candidates.size() << " slots" << std::endl;
+                    return std::make_tuple(data, bookedCount);
+                };
+
+                if (accepted.empty()) {
+                    auto [data, bookedCount] = bulkReply(candidates, outcomes, std::vector<std::string>(candidates.size()));
+                    auto [total_length, replyBuffer] = msg.createReply(data, 1);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
+                    break;
+                }
+
+                // All accepted slots are inserted back to back in one transaction and answered by a single sync
+                std::vector<size_t> bookedPositions;
+                for (size_t i = 0; i < candidates.size(); i++) {
+                    if (outcomes[i] == slotBooked) {
+                        bookedPositions.push_back(i);
+                    }
+                }
+                auto bookingIDs = std::make_shared<std::vector<std::string>>(candidates.size());
+                for (size_t i = 0; i < accepted.size(); i++) {
+                    size_t position = bookedPositions[i];
+                    db.send(INSERT_BOOKING_SQL, retention.insertParams(fac.booking(accepted[i])), [bookingIDs, position](PGresult* res) {
+                        if (res != nullptr && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0) {
+                            (*bookingIDs)[position] = PQgetvalue(res, 0, 0);
                         }
-                    } else {
-                        std::cerr << "Not the user" << std::endl;
+                    });
+                }
+                bool tookTicket = suspend(msg, clientKey);
+                sockaddr_in address = clientAddress;
+                std::string key = clientKey;
+                facility* bookingFacility = &fac;
+                fac.pendingWrites++;
+                db.sync([this, msg, key, address, tookTicket, bookingFacility, accepted, bookedPositions, candidates, outcomes, bookingIDs, bulkReply](bool ok) mutable {
+                    bookingFacility->pendingWrites--;
+                    for (size_t i = 0; i < accepted.size(); i++) {
+                        const std::string& bookingID = (*bookingIDs)[bookedPositions[i]];
+                        ok = ok && !bookingID.empty();
+                    }
+                    for (size_t i = 0; i < accepted.size(); i++) {
+                        if (ok) {
+                            bookingFacility->confirmBooking(accepted[i], (*bookingIDs)[bookedPositions[i]]);
+                        } else {
+                            const Booking& candidate = candidates[bookedPositions[i]];
+                            auditLog.record(candidate.facilityId, candidate.userName, candidate.bookingStartDay, candidate.bookingStartHour, candidate.bookingStartMinute,
+                                            candidate.bookingEndDay, candidate.bookingEndHour, candidate.bookingEndMinute, auditNotSaved);
+                            bookingFacility->rejectBooking(accepted[i]);
+                            outcomes[bookedPositions[i]] = slotNotCommitted;
+                        }
+                    }
+                    if (!ok) {
+                        std::cerr << "Failed to save bulk booking" << std::endl;
+                    }
+                    // Status 1 tells all-or-nothing callers that nothing was booked
+                    auto [data, bookedCount] = bulkReply(candidates, outcomes, *bookingIDs);
+                    resume(msg, key, address, tookTicket, data, bookedCount == 0 ? 1 : 0, ok);
+                });
+                break;
+            }
+
+            case 9: {
+                // Utilization over week ranges and the busiest hours, from the occupancy prefix sums only
+                int offset = 0;
+                const std::vector<unsigned char>& payload = msg.msg.messageData;
+                bool validRequest = payload.size() >= 1;
+                std::vector<facility*> selected;
+                uint8_t facilityCount = validRequest ? payload[offset] : 0;
+                offset += sizeof(facilityCount);
+                for (int i = 0; validRequest && i < facilityCount; i++) {
+                    validRequest = payload.size() >= (size_t)offset + sizeof(facilityNameLength);
+                    if (!validRequest) {
+                        break;
+                    }
+                    memcpy(&facilityNameLength, payload.data() + offset, sizeof(facilityNameLength));
+                    facilityNameLength = ntohl(facilityNameLength);
+                    offset += sizeof(facilityNameLength);
+                    validRequest = payload.size() >= (size_t)offset + facilityNameLength;
+                    if (!validRequest) {
+                        break;
+                    }
+                    facilityName = std::string((char*)payload.data() + offset, static_cast<size_t>(facilityNameLength));
+                    offset += facilityNameLength;
+                    std::cout << "Facility Name: " << facilityName << std::endl;
+                    facility* fac = facilities.find(facilityName);
+                    if (fac == nullptr) {
+                        std::cerr << "Unknown facility: " << facilityName << std::endl;
                         std::vector<unsigned char> data;
-                        auto [total_length, replyBuffer] = msg.createReply(data, 2);
-                        std::unordered_map<uint32_t, std::string> responseMap;
-                        responseMap[msg.msg.requestID] = std::string(replyBuffer, total_length);
-                        prevRequestData.emplace(ipStr, responseMap);
-                        sendto(socket_fd, replyBuffer, total_length, 0, (struct sockaddr *)&clientAddress, clientAddressLength);
+                        auto [total_length, replyBuffer] = msg.createReply(data, 1);
+                        prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                        sendReply(clientAddress, replyBuffer, total_length);
+                        delete[] replyBuffer;
+                        return;
                     }
-                    conn.close();
+                    selected.push_back(fac);
+                }
+                // No facilities listed means all of them
+                if (validRequest && facilityCount == 0) {
+                    for (auto& [name, fac] : facilities.facilitiesByName) {
+                        selected.push_back(fac.get());
+                    }
+                }
+                uint8_t rangeCount = 0;
+                if (validRequest) {
+                    validRequest = payload.size() >= (size_t)offset + 1;
+                    rangeCount = validRequest ? payload[offset] : 0;
+                    offset += sizeof(rangeCount);
+                    validRequest = validRequest && payload.size() >= (size_t)offset + rangeCount * 6 + 1;
+                }
+                std::vector<std::pair<uint, uint>> ranges;
+                for (int i = 0; validRequest && i < rangeCount; i++) {
+                    const unsigned char* range = payload.data() + offset + i * 6;
+                    // End 7:00:00 stands for the end of the week
+                    bool endOfWeek = range[3] == 7 && range[4] == 0 && range[5] == 0;
+                    validRequest = validWeekTime(range[0], range[1], range[2]) && (endOfWeek || validWeekTime(range[3], range[4], range[5]));
+                    uint from = toWeekMinute(range[0], range[1], range[2]);
+                    uint to = endOfWeek ? MINUTES_PER_WEEK : toWeekMinute(range[3], range[4], range[5]);
+                    validRequest = validRequest && from < to;
+                    ranges.emplace_back(from, to);
+                }
+                uint8_t topK = validRequest ? payload[offset + rangeCount * 6] : 0;
+                if (!validRequest) {
+                    std::cerr << "Invalid analytics request" << std::endl;
+                    std::vector<unsigned char> data;
+                    auto [total_length, replyBuffer] = msg.createReply(data, 3);
+                    prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                    sendReply(clientAddress, replyBuffer, total_length);
+                    delete[] replyBuffer;
                     break;
                 }
+                std::cout << "Facilities: " << selected.size() << ", ranges: " << ranges.size() << ", top: " << (int)topK << std::endl;
 
-                default:
-                    break;
+                // Per range: occupied minutes, available minutes and utilization in basis points
+                std::vector<unsigned char> data;
+                auto putUint32 = [&data](uint32_t value) {
+                    value = htonl(value);
+                    data.insert(data.end(), (unsigned char*)&value, (unsigned char*)&value + sizeof(value));
+                };
+                auto putUint16 = [&data](uint16_t value) {
+                    value = htons(value);
+                    data.insert(data.end(), (unsigned char*)&value, (unsigned char*)&value + sizeof(value));
+                };
+                data.push_back((unsigned char)ranges.size());
+                for (const auto& [from, to] : ranges) {
+                    uint64_t occupied = 0;
+                    for (facility* fac : selected) {
+                        occupied += fac->occupancy.occupied(from, to);
+                    }
+                    uint64_t capacity = (uint64_t)(to - from) * selected.size();
+                    putUint32((uint32_t)occupied);
+                    putUint32((uint32_t)capacity);
+                    putUint16(capacity == 0 ? 0 : (uint16_t)(occupied * 10000 / capacity));
                 }
-                
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                if (!running) break;
+
+                // Busiest hours of the week across the selected facilities
+                std::vector<std::pair<uint64_t, uint>> slots;
+                for (uint slot = 0; slot < SLOTS_PER_WEEK; slot++) {
+                    uint64_t occupied = 0;
+                    for (facility* fac : selected) {
+                        occupied += fac->occupancy.occupied(slot * 60, slot * 60 + 60);
+                    }
+                    if (occupied > 0) {
+                        slots.emplace_back(occupied, slot);
+                    }
+                }
+                size_t shown = std::min<size_t>(topK, slots.size());
+                std::partial_sort(slots.begin(), slots.begin() + shown, slots.end(), [](const auto& a, const auto& b) {
+                    return a.first != b.first ? a.first > b.first : a.second < b.second;
+                });
+                data.push_back((unsigned char)shown);
+                for (size_t i = 0; i < shown; i++) {
+                    const auto& [occupied, slot] = slots[i];
+                    data.push_back((unsigned char)(slot / 24));
+                    data.push_back((unsigned char)(slot % 24));
+                    putUint32((uint32_t)occupied);
+                    putUint16((uint16_t)(occupied * 10000 / (60 * selected.size())));
+                }
+
+                auto [total_length, replyBuffer] = msg.createReply(data);
+                prevRequestData[clientKey][msg.msg.requestID] = std::string(replyBuffer, total_length);
+                sendReply(clientAddress, replyBuffer, total_length);
+                delete[] replyBuffer;
+                break;
+            }
+
+            default:
+                break;
             }
-            std::cout << "Exiting listen loop" << std::endl;
-            std::cout << "Closing socket" << std::endl;
-            close(socket_fd);
-            std::cout << "Socket closed" << std::endl;
         }
 
 
 };
 
-void notificationListenerThread() {
+void notificationListenerThread(const AsyncDatabase* db) {
     try {
         pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
         pqxx::work txn(conn);
         txn.exec("LISTEN booking_update");
         txn.commit();
+        notificationsListening = true;
 
         conn.listen("booking_update", [&](pqxx::notification notif) {
             std::string channel = std::string(notif.channel);
@@ -537,70 +1330,67 @@ void notificationListenerThread() {
             ss.ignore(1, ':');
             ss >> bookingStatus;
 
-            if (bookingStatus != booked) {
-                std::cout << "Booking Status: " << bookingStatus << std::endl;
-                std::cout << "Booking not confirmed" << std::endl;
-                return;
-            } 
             if (action == "INSERT" || action == "UPDATE" || action == "DELETE") {
                 std::cout << "Action: " << action << std::endl;
                 std::cout << "Facility Name: " << facilityName << std::endl;
-
-                auto range = clients.equal_range(facilityName);
-                for (auto it = range.first; it != range.second; ++it) {
-                    if (std::chrono::steady_clock::now() < it->second.expires) {
-                        std::vector<unsigned char> data;
-                        std::string msg;
-
-                        if (action == "INSERT" || action == "UPDATE") {
-                            msg = "📢 Booking " + action + " for facility " + facilityName +
-                                  " from Day " + std::to_string(startDay) + " " +
-                                  std::to_string(startHour) + ":" + std::to_string(startMinute) +
-                                  " to Day " + std::to_string(endDay) + " " +
-                                  std::to_string(endHour) + ":" + std::to_string(endMinute);
-                        } else { // DELETE
-                            msg = "📢 Booking " + action + " for facility " + facilityName;
-                        }
-
-                        data.push_back((unsigned char)msg.size());
-                        data.insert(data.end(), msg.begin(), msg.end());
-                        auto [totallenght, replybuffer] = it->second.msg.createReply(data);
-                        std::cout << "Sending notification to client" << std::endl;
-                        sendto(it->second.socket_fd, replybuffer, totallenght, 0,
-                               (struct sockaddr *)&it->second.clientAddress, it->second.clientAddressLength);
-                    } else {
-                        std::cout << "Client expired: " << std::endl;
-                    }
+                std::cout << "Booking Status: " << bookingStatus << std::endl;
+                monitors.publish(action, facilityName, startDay, startHour, startMinute, endDay, endHour, endMinute, bookingStatus);
+                // Rows written by scripts, imports or other tools have to reach the resident schedule
+                if (notif.backend_pid != db->backendPid.load()) {
+                    externalChanges.add(facilityName);
                 }
             } else {
                 std::cerr << "Invalid action" << std::endl;
             }
         });
 
-        while (running) {
-            if (!conn.await_notification(1)) {
-                continue;
-            }
+        // Wake up often enough to close coalescing windows on time
+        while (notificationsRunning) {
+            conn.await_notification(0, 20000);
+            monitors.flushDue(std::chrono::steady_clock::now());
         }
     }
     catch (const std::exception &e) {
         std::cerr << "Error in notification listener thread: " << e.what() << std::endl;
     }
+    notificationsListening = false;
 }
 
 
 
-int main() {
+int main(int argc, char* argv[]) {
     std::cout << "Starting server..." << std::endl;
     std::signal(SIGINT, handleSignal);
     std::signal(SIGTERM, handleSignal);
+    // Failed and past-week bookings leave the booking table before anything is loaded
+    retention.prepare();
+    // Prefer the snapshot from the last clean shutdown, then a bulk load, then loading one facility at a time
+    if (!startupLoader.loadSnapshot(SNAPSHOT_PATH) && !startupLoader.bulkLoad()) {
+        facilities.loadAll();
+    }
+    tokenIndex.load();
+    std::cout << "Resident bookings: " << facilities.bookingCount() << " in " << facilities.bookingMemoryBytes() << " bytes" << std::endl;
     Connection conn;
-    std::thread notificationThread(notificationListenerThread);
+    // --capture <file> records every request, reply and monitor callback for the replay tool
+    // --monitor-window <ms> sets how long monitor changes are coalesced
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--capture" && !conn.capture.open(argv[i + 1])) {
+            return 1;
+        }
+        if (std::string(argv[i]) == "--monitor-window") {
+            monitors.window = std::chrono::milliseconds(std::stoi(argv[i + 1]));
+        }
+    }
+    monitors.capture = &conn.capture;
+    std::thread notificationThread(notificationListenerThread, &conn.db);
     std::thread listenerThread([&conn]() {
         conn.listen();
     });
-    notificationThread.join();
     listenerThread.join();
+    startupLoader.writeSnapshot(SNAPSHOT_PATH, [&conn]() { return conn.inSync(); });
+    notificationsRunning = false;
+    notificationThread.join();
+    auditLog.close();
 
     std::cout << "Server stopped" << std::endl;
 }
\ No newline at end of file
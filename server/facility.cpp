@@ -3,18 +3,142 @@
 #include <iostream>
 #include <cstring>
 #include "bookings.cpp"
+#include "bookingstore.cpp"
+#include "analytics.cpp"
 #include <vector>
 #include <string>
 #include <pqxx/pqxx>
 #include <map>
-#endif
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <optional>
+#include <algorithm>
+
+class facility;
 
+// Location of a booking inside its facility's schedule
+struct BookingRef {
+    facility* fac;
+    size_t index;
+};
+
+// Secondary indexes over the facility schedules. They point into the
+// facilities owned by the registry instead of copying bookings.
+class BookingIndex {
+    public:
+        // Keyed by interned user name and numeric booking ID
+        std::unordered_map<uint32_t, std::vector<BookingRef>> bookingsByUser;
+        std::unordered_map<uint32_t, BookingRef> bookingsById;
+
+        void add(uint32_t user, uint32_t bookingId, facility* fac, size_t index) {
+            bookingsByUser[user].push_back(BookingRef{fac, index});
+            if (bookingId != NO_BOOKING_ID) {
+                bookingsById[bookingId] = BookingRef{fac, index};
+            }
+        }
+
+        // Approximate heap use: reference vectors, hash nodes (a next pointer
+        // and the key/value pair) and bucket arrays. Allocator headers are not counted.
+        size_t memoryBytes() const {
+            size_t bytes = bookingsByUser.bucket_count() * sizeof(void*) +
+                           bookingsByUser.size() * (sizeof(void*) + sizeof(std::pair<const uint32_t, std::vector<BookingRef>>));
+            for (const auto& [user, refs] : bookingsByUser) {
+                bytes += refs.capacity() * sizeof(BookingRef);
+            }
+            bytes += bookingsById.bucket_count() * sizeof(void*) +
+                     bookingsById.size() * (sizeof(void*) + sizeof(std::pair<const uint32_t, BookingRef>));
+            return bytes;
+        }
+};
+
+BookingIndex bookingIndex;
+
+// Serialized availability of one day: [day][slot count][start hour, start minute, end hour, end minute]...
+struct AvailabilityFragment {
+    bool built = false;
+    uint32_t version = 0;
+    std::vector<unsigned char> bytes;
+};
+
+// Per-slot results of a bulk booking
+enum SlotOutcome {
+    slotBooked = 0,
+    slotConflict = 1,
+    slotConflictInBatch = 2,
+    slotInvalid = 3,
+    slotNotCommitted = 4
+};
+
+// The conflict rule of is_conflicting, on the hours of two bookings that start on the same day
+bool hoursConflict(uint startHour, uint endHour, uint otherStartHour, uint otherEndHour) {
+    return startHour < otherEndHour && endHour > otherStartHour;
+}
+
+// Hours covered by a booking as a bit mask. For two bookings whose end hour is
+// after their start hour, hoursConflict holds exactly when the masks
+// intersect. A booking that starts and ends within one hour (or wraps past
+// midnight) has mask 0 and must be compared with hoursConflict instead.
+uint32_t hourMask(uint startHour, uint endHour) {
+    if (endHour <= startHour) {
+        return 0;
+    }
+    return ((1u << endHour) - 1) & ~((1u << startHour) - 1);
+}
+
+// Booked hours of one day for batch conflict checks: the union of masks, and
+// the bookings that have no mask, which are checked one by one
+struct DayHours {
+    uint32_t mask = 0;
+    std::vector<std::pair<uint, uint>> all;
+    std::vector<std::pair<uint, uint>> unmasked;
+
+    void add(uint startHour, uint endHour) {
+        all.emplace_back(startHour, endHour);
+        if (endHour > startHour) {
+            mask |= hourMask(startHour, endHour);
+        } else {
+            unmasked.emplace_back(startHour, endHour);
+        }
+    }
+
+    bool conflicts(uint startHour, uint endHour) const {
+        const std::vector<std::pair<uint, uint>>& scalar = endHour > startHour ? unmasked : all;
+        if (endHour > startHour && (mask & hourMask(startHour, endHour))) {
+            return true;
+        }
+        for (const auto& [otherStart, otherEnd] : scalar) {
+            if (hoursConflict(startHour, endHour, otherStart, otherEnd)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
 
 class facility {
     public:
         std::string facilityId;
         std::string facilityName;
-        std::vector<Booking> bookings;
+        BookingStore bookings;
+        // Bumped whenever a booking on that day changes; fragments built at an older version are stale
+        uint32_t dayVersions[7] = {0};
+        AvailabilityFragment fragments[7];
+        // Booked minutes of the week, kept in step with every booking change
+        OccupancyIndex occupancy;
+        // Database writes whose callbacks refer to bookings by position; the
+        // compactor leaves the facility alone until they have finished
+        uint32_t pendingWrites = 0;
+        // Bookings the database refused, still taking up a position
+        uint32_t tombstones = 0;
+        // Booking changes sent to the database and not answered yet. A reload
+        // read before they land would undo them in memory.
+        uint32_t pendingModifies = 0;
+
+        // Empty facility, filled in by the startup loader without touching the database
+        facility() {}
+
         facility(std::string facilityName) {
             pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
             if (conn.is_open()) {
@@ -49,56 +173,445 @@ class facility {
             pqxx::result bookingRes = txn.exec(bookingQuery);
             for (pqxx::result::const_iterator row = bookingRes.begin(); row != bookingRes.end(); ++row) {
                 std::string bookingId = row[0].as<std::string>();
-                std::string facilityId = row[1].as<std::string>();
                 std::string userName = row[2].as<std::string>();
-                uint bookingStartDay = static_cast<uint>(row[3].as<int>());
-                uint bookingStartHour = static_cast<uint>(row[4].as<int>());
-                uint bookingStartMinute = static_cast<uint>(row[5].as<int>());
-                uint bookingEndDay = static_cast<uint>(row[6].as<int>());
-                uint bookingEndHour = static_cast<uint>(row[7].as<int>());
-                uint bookingEndMinute = static_cast<uint>(row[8].as<int>());
-                uint bookingStatus = static_cast<uint>(row[9].as<int>());
-                Booking booking(facilityId, bookingStartDay, bookingStartHour, bookingStartMinute, bookingEndDay, bookingEndHour, bookingEndMinute, userName, bookingId, bookingStatus);
-                bookings.push_back(booking);
+                // NULL reads as -1 and is rejected like any out of range value, as in the bulk load
+                auto column = [&row](int i) { return row[i].is_null() ? -1 : row[i].as<int>(); };
+                uint bookingStartDay = static_cast<uint>(column(3));
+                uint bookingStartHour = static_cast<uint>(column(4));
+                uint bookingStartMinute = static_cast<uint>(column(5));
+                uint bookingEndDay = static_cast<uint>(column(6));
+                uint bookingEndHour = static_cast<uint>(column(7));
+                uint bookingEndMinute = static_cast<uint>(column(8));
+                uint bookingStatus = static_cast<uint>(column(9));
+                addLoadedBooking(bookingKey(bookingId), userName, bookingStartDay, bookingStartHour, bookingStartMinute, bookingEndDay, bookingEndHour, bookingEndMinute, bookingStatus);
             }
             conn.close();
         }
 
-        std::tuple<int, std::string> addBooking(uint bookingStartDay, uint bookingStartHour, uint bookingStartMinute, uint bookingEndDay, uint bookingEndHour, uint bookingEndMinute, std::string userName) {
-            Booking booking(this->facilityId, bookingStartDay, bookingStartHour, bookingStartMinute, bookingEndDay, bookingEndHour, bookingEndMinute, userName);
-            for (Booking prevbooking : bookings) {
-                if (prevbooking.bookingStatus == booked && prevbooking.is_conflicting(booking)) {
-                    std::cout << "Booking conflict detected!" << std::endl;
-                    booking.bookingStatus = failed;
-                    booking.saveToDatabase(); // Save failed booking to database
-                    // Return 1 to indicate failure
-                    bookings.push_back(booking);
-                    return {(uint8_t)1, "Booking conflict detected!"};
+        // Bookings whose times do not fit in a week are left in the database
+        // only. Failed attempts belong in the audit log and are not loaded.
+        bool addLoadedBooking(uint32_t bookingId, const std::string& userName, uint startDay, uint startHour, uint startMinute, uint endDay, uint endHour, uint endMinute, uint status) {
+            if (status == failed) {
+                return false;
+            }
+            if (status > failed) {
+                std::cerr << "Skipping booking " << bookingId << " with unknown status " << status << std::endl;
+                return false;
+            }
+            if (!validWeekTime(startDay, startHour, startMinute) || !validWeekTime(endDay, endHour, endMinute)) {
+                std::cerr << "Skipping booking " << bookingId << " with out of range times" << std::endl;
+                return false;
+            }
+            uint32_t user = userNames.intern(userName);
+            size_t index = bookings.append(bookingId, user, toWeekMinute(startDay, startHour, startMinute), toWeekMinute(endDay, endHour, endMinute), status);
+            bookingIndex.add(user, bookingId, this, index);
+            if (status == booked) {
+                occupancy.add(bookings.starts[index], bookings.ends[index]);
+            }
+            return true;
+        }
+
+        // Converts a resident booking for code that works with the Booking API
+        Booking booking(size_t index) const {
+            return bookings.toBooking(index, facilityId);
+        }
+
+        // Same test as Booking::is_conflicting: same start day and overlapping hours
+        bool conflictsWithBooked(uint day, uint startHour, uint endHour) const {
+            for (size_t i = 0; i < bookings.size(); i++) {
+                if (bookings.status(i) == booked && bookings.day(i) == day &&
+                    hoursConflict(startHour, endHour, weekHour(bookings.starts[i]), weekHour(bookings.ends[i]))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Decides a booking against the resident schedule and records it
+        // straight away so later requests see the slot as taken. The booking has
+        // no ID until the caller has saved it and called confirmBooking. Times
+        // must pass validWeekTime. A conflicting attempt is not recorded; the
+        // caller writes it to the audit log.
+        std::tuple<int, size_t> addBooking(uint bookingStartDay, uint bookingStartHour, uint bookingStartMinute, uint bookingEndDay, uint bookingEndHour, uint bookingEndMinute, std::string userName) {
+            if (conflictsWithBooked(bookingStartDay, bookingStartHour, bookingEndHour)) {
+                std::cout << "Booking conflict detected!" << std::endl;
+                return {1, bookings.size()}; // Return 1 to indicate failure
+            }
+            uint32_t user = userNames.intern(userName);
+            size_t index = bookings.append(NO_BOOKING_ID, user, toWeekMinute(bookingStartDay, bookingStartHour, bookingStartMinute), toWeekMinute(bookingEndDay, bookingEndHour, bookingEndMinute), booked);
+            bookingIndex.add(user, NO_BOOKING_ID, this, index);
+            invalidateDay(bookingStartDay);
+            occupancy.add(bookings.starts[index], bookings.ends[index]);
+            return {0, index}; // Return 0 to indicate success
+        }
+
+        void confirmBooking(size_t index, const std::string& bookingID) {
+            bookings.ids[index] = bookingKey(bookingID);
+            bookingIndex.bookingsById[bookings.ids[index]] = BookingRef{this, index};
+        }
+
+        // The database refused a booking that was already recorded in memory
+        void rejectBooking(size_t index) {
+            if (bookings.status(index) == booked) {
+                invalidateDay(bookings.day(index));
+                occupancy.remove(bookings.starts[index], bookings.ends[index]);
+            }
+            bookings.setStatus(index, failed);
+            tombstones++;
+        }
+
+        // Checks every candidate against the schedule in one pass over per-day hour
+        // masks, with the same outcome as conflictsWithBooked (tests/hour_mask_test.cpp
+        // checks that). Accepted candidates are recorded like addBooking does and
+        // their positions returned in accepted; the caller saves them in one
+        // transaction. With allOrNothing a single rejected slot means none are accepted.
+        std::vector<uint8_t> addBookings(std::vector<Booking>& candidates, bool allOrNothing, std::vector<size_t>& accepted) {
+            DayHours bookedHours[7];
+            for (size_t i = 0; i < bookings.size(); i++) {
+                if (bookings.status(i) == booked) {
+                    bookedHours[bookings.day(i)].add(weekHour(bookings.starts[i]), weekHour(bookings.ends[i]));
+                }
+            }
+            DayHours batchHours[7];
+            std::vector<uint8_t> outcomes(candidates.size(), slotBooked);
+            bool anyRejected = false;
+            for (size_t i = 0; i < candidates.size(); i++) {
+                const Booking& candidate = candidates[i];
+                uint day = candidate.bookingStartDay;
+                bool residentConflict = bookedHours[day].conflicts(candidate.bookingStartHour, candidate.bookingEndHour);
+                if (residentConflict) {
+                    outcomes[i] = slotConflict;
+                } else if (batchHours[day].conflicts(candidate.bookingStartHour, candidate.bookingEndHour)) {
+                    outcomes[i] = slotConflictInBatch;
+                } else {
+                    batchHours[day].add(candidate.bookingStartHour, candidate.bookingEndHour);
+                    continue;
+                }
+                anyRejected = true;
+            }
+
+            for (size_t i = 0; i < candidates.size(); i++) {
+                if (outcomes[i] != slotBooked) {
+                    continue;
+                }
+                if (allOrNothing && anyRejected) {
+                    outcomes[i] = slotNotCommitted;
+                    continue;
+                }
+                Booking& candidate = candidates[i];
+                candidate.bookingStatus = booked;
+                uint32_t user = userNames.intern(candidate.userName);
+                size_t index = bookings.append(NO_BOOKING_ID, user,
+                                               toWeekMinute(candidate.bookingStartDay, candidate.bookingStartHour, candidate.bookingStartMinute),
+                                               toWeekMinute(candidate.bookingEndDay, candidate.bookingEndHour, candidate.bookingEndMinute), booked);
+                bookingIndex.add(user, NO_BOOKING_ID, this, index);
+                invalidateDay(candidate.bookingStartDay);
+                occupancy.add(bookings.starts[index], bookings.ends[index]);
+                accepted.push_back(index);
+            }
+            return outcomes;
+        }
+
+        void updateBooking(size_t index, const Booking& booking) {
+            invalidateDay(bookings.day(index));
+            if (bookings.status(index) == booked) {
+                occupancy.remove(bookings.starts[index], bookings.ends[index]);
+            }
+            bookings.assign(index, booking);
+            invalidateDay(booking.bookingStartDay);
+            if (bookings.status(index) == booked) {
+                occupancy.add(bookings.starts[index], bookings.ends[index]);
+            }
+        }
+
+        // Brings the schedule in line with this facility's rows as read from the
+        // database after another session wrote to them. Positions never move:
+        // changed rows are updated in place, rows that are gone become failed
+        // entries for the compactor and new rows are appended. Bookings this
+        // server has not saved yet are left alone. Returns how many entries changed
+        // and sets a bit in changedDays for every day a booking left or entered.
+        // Bookings that were removed or are no longer booked go to unbooked.
+        size_t reconcile(const std::vector<Booking>& rows, uint8_t& changedDays, std::vector<uint32_t>& unbooked) {
+            std::unordered_map<uint32_t, const Booking*> rowsById;
+            for (const Booking& row : rows) {
+                rowsById[bookingKey(row.bookingID)] = &row;
+            }
+            size_t changed = 0;
+            for (size_t i = 0; i < bookings.size(); i++) {
+                uint32_t bookingId = bookings.ids[i];
+                if (bookingId == NO_BOOKING_ID || bookings.status(i) == failed) {
+                    continue;
+                }
+                auto found = rowsById.find(bookingId);
+                const Booking* row = found == rowsById.end() ? nullptr : found->second;
+                rowsById.erase(bookingId);
+                bool keep = row != nullptr && row->bookingStatus != failed &&
+                            validWeekTime(row->bookingStartDay, row->bookingStartHour, row->bookingStartMinute) &&
+                            validWeekTime(row->bookingEndDay, row->bookingEndHour, row->bookingEndMinute);
+                if (!keep) {
+                    changedDays |= 1 << bookings.day(i);
+                    rejectBooking(i);
+                    unbooked.push_back(bookingId);
+                    bookingIndex.bookingsById.erase(bookingId);
+                    changed++;
+                    continue;
+                }
+                Booking current = booking(i);
+                if (current.userName != row->userName || current.bookingStatus != row->bookingStatus ||
+                    current.bookingStartDay != row->bookingStartDay || current.bookingStartHour != row->bookingStartHour ||
+                    current.bookingStartMinute != row->bookingStartMinute || current.bookingEndDay != row->bookingEndDay ||
+                    current.bookingEndHour != row->bookingEndHour || current.bookingEndMinute != row->bookingEndMinute) {
+                    if (current.userName != row->userName) {
+                        std::vector<BookingRef>& refs = bookingIndex.bookingsByUser[bookings.users[i]];
+                        refs.erase(std::remove_if(refs.begin(), refs.end(), [this, i](const BookingRef& ref) { return ref.fac == this && ref.index == i; }), refs.end());
+                        bookingIndex.add(userNames.intern(row->userName), bookingId, this, i);
+                    }
+                    changedDays |= 1 << bookings.day(i);
+                    changedDays |= 1 << row->bookingStartDay;
+                    if (row->bookingStatus != booked) {
+                        unbooked.push_back(bookingId);
+                    }
+                    updateBooking(i, *row);
+                    changed++;
+                }
+            }
+            for (const Booking& row : rows) {
+                uint32_t bookingId = bookingKey(row.bookingID);
+                if (!rowsById.count(bookingId)) {
+                    continue;
+                }
+                if (addLoadedBooking(bookingId, row.userName, row.bookingStartDay, row.bookingStartHour, row.bookingStartMinute,
+                                     row.bookingEndDay, row.bookingEndHour, row.bookingEndMinute, row.bookingStatus)) {
+                    invalidateDay(row.bookingStartDay);
+                    changedDays |= 1 << row.bookingStartDay;
+                    changed++;
+                }
+            }
+            return changed;
+        }
+
+        // Rewrites the columns without failed entries and points the indexes
+        // at the new positions. Returns how many entries were dropped.
+        size_t compact() {
+            unindex();
+            BookingStore kept;
+            for (size_t i = 0; i < bookings.size(); i++) {
+                if (bookings.status(i) != failed) {
+                    kept.append(bookings.ids[i], bookings.users[i], bookings.starts[i], bookings.ends[i], bookings.status(i));
                 }
             }
-            booking.bookingStatus = booked;
-            booking.saveToDatabase(); // Save successful booking to database
-            bookings.push_back(booking);
-            return {0, booking.bookingID}; // Return 0 to indicate success
-        } 
+            size_t removed = bookings.size() - kept.size();
+            bookings = std::move(kept);
+            for (size_t i = 0; i < bookings.size(); i++) {
+                bookingIndex.add(bookings.users[i], bookings.ids[i], this, i);
+            }
+            tombstones = 0;
+            return removed;
+        }
+
+        // Empties the resident schedule when its week is over
+        void clearSchedule() {
+            unindex();
+            bookings = BookingStore();
+            occupancy.data.reset();
+            tombstones = 0;
+            for (uint day = 0; day < 7; day++) {
+                invalidateDay(day);
+            }
+        }
+
+        void unindex() {
+            for (uint32_t bookingId : bookings.ids) {
+                auto found = bookingIndex.bookingsById.find(bookingId);
+                if (found != bookingIndex.bookingsById.end() && found->second.fac == this) {
+                    bookingIndex.bookingsById.erase(found);
+                }
+            }
+            for (uint32_t user : bookings.users) {
+                auto found = bookingIndex.bookingsByUser.find(user);
+                if (found == bookingIndex.bookingsByUser.end()) {
+                    continue;
+                }
+                std::vector<BookingRef>& refs = found->second;
+                refs.erase(std::remove_if(refs.begin(), refs.end(), [this](const BookingRef& ref) { return ref.fac == this; }), refs.end());
+                if (refs.empty()) {
+                    bookingIndex.bookingsByUser.erase(found);
+                }
+            }
+        }
+
+        void invalidateDay(uint day) {
+            if (day < 7) {
+                dayVersions[day]++;
+            }
+        }
+
+        const std::vector<unsigned char>& availabilityFragment(uint day) {
+            AvailabilityFragment& fragment = fragments[day];
+            if (fragment.built && fragment.version == dayVersions[day]) {
+                return fragment.bytes;
+            }
+            std::map<uint, uint> slots = getBookingTimes(day);
+            fragment.bytes.clear();
+            fragment.bytes.push_back((unsigned char)day);
+            fragment.bytes.push_back((unsigned char)slots.size());
+            for (const auto& [start, end] : slots) {
+                fragment.bytes.push_back((unsigned char)(start / 100));
+                fragment.bytes.push_back((unsigned char)(start % 100));
+                fragment.bytes.push_back((unsigned char)(end / 100));
+                fragment.bytes.push_back((unsigned char)(end % 100));
+            }
+            fragment.version = dayVersions[day];
+            fragment.built = true;
+            return fragment.bytes;
+        }
 
         std::map<uint, uint> getBookingTimes(uint queryDay) {
             std::map<uint, uint> bookedSlots;
-            for (Booking booking : bookings) {
-                std::cout << "Booking ID: " << booking.bookingID << std::endl;
-                std::cout << "Facility ID: " << booking.facilityId << std::endl;
-                std::cout << "Booking Start Day: " << booking.bookingStartDay << std::endl;
-                std::cout << "Booking Start Hour: " << booking.bookingStartHour << std::endl;
-                std::cout << "Booking Start Minute: " << booking.bookingStartMinute << std::endl;
-                std::cout << "Booking End Day: " << booking.bookingEndDay << std::endl;
-                if (booking.bookingStatus == booked && booking.bookingStartDay == queryDay) {
-                    if (booking.bookingEndDay != booking.bookingStartDay) {
-                        bookedSlots[booking.bookingStartHour * 100 + booking.bookingStartMinute] = 2359;
+            for (size_t i = 0; i < bookings.size(); i++) {
+                if (bookings.status(i) == booked && bookings.day(i) == queryDay) {
+                    WeekMinute start = bookings.starts[i];
+                    WeekMinute end = bookings.ends[i];
+                    if (weekDay(end) != weekDay(start)) {
+                        bookedSlots[weekHour(start) * 100 + weekMinute(start)] = 2359;
                     } else {
-                        bookedSlots[booking.bookingStartHour * 100 + booking.bookingStartMinute] = booking.bookingEndHour * 100 + booking.bookingEndMinute;
+                        bookedSlots[weekHour(start) * 100 + weekMinute(start)] = weekHour(end) * 100 + weekMinute(end);
                     }
                 }
             }
+            std::cout << "Booked slots on day " << queryDay << ": " << bookedSlots.size() << std::endl;
             return bookedSlots;
         }
-};
\ No newline at end of file
+};
+
+// Owns every loaded facility so that bookingIndex can keep pointers into them
+class FacilityRegistry {
+    public:
+        std::unordered_map<std::string, std::unique_ptr<facility>> facilitiesByName;
+
+        facility& get(const std::string& facilityName) {
+            auto found = facilitiesByName.find(facilityName);
+            if (found != facilitiesByName.end()) {
+                return *found->second;
+            }
+            auto fac = std::make_unique<facility>(facilityName);
+            facility& ref = *fac;
+            facilitiesByName.emplace(facilityName, std::move(fac));
+            return ref;
+        }
+
+        // Registers a facility whose rows were fetched in bulk
+        facility& adopt(const std::string& facilityId, const std::string& facilityName) {
+            auto fac = std::make_unique<facility>();
+            fac->facilityId = facilityId;
+            fac->facilityName = facilityName;
+            facility& ref = *fac;
+            facilitiesByName[facilityName] = std::move(fac);
+            return ref;
+        }
+
+        void loadAll() {
+            // Every facility must be resident for user lookups to be answered from memory
+            std::vector<std::string> facilityNames;
+            try {
+                pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
+                if (conn.is_open()) {
+                    std::cout << "Connected to database" << std::endl;
+                } else {
+                    std::cerr << "Failed to connect to database" << std::endl;
+                    return;
+                }
+                pqxx::work txn(conn);
+                pqxx::result res = txn.exec("SELECT facility_name FROM facility;");
+                for (const auto& row : res) {
+                    facilityNames.push_back(row[0].as<std::string>());
+                }
+                conn.close();
+            }
+            catch (const std::exception &e) {
+                std::cerr << "Error loading facilities: " << e.what() << std::endl;
+            }
+            for (const std::string& facilityName : facilityNames) {
+                get(facilityName);
+            }
+            std::cout << "Loaded " << facilitiesByName.size() << " facilities" << std::endl;
+        }
+
+        // Writes back a modified copy of a resident booking
+        bool updateBooking(const Booking& booking) {
+            auto found = bookingIndex.bookingsById.find(bookingKey(booking.bookingID));
+            if (found == bookingIndex.bookingsById.end()) {
+                return false;
+            }
+            found->second.fac->updateBooking(found->second.index, booking);
+            return true;
+        }
+
+        // Resident facility by name, without creating it
+        facility* find(const std::string& facilityName) {
+            auto found = facilitiesByName.find(facilityName);
+            return found == facilitiesByName.end() ? nullptr : found->second.get();
+        }
+
+        std::optional<Booking> findBooking(const std::string& bookingID) {
+            auto found = bookingIndex.bookingsById.find(bookingKey(bookingID));
+            if (found == bookingIndex.bookingsById.end()) {
+                return std::nullopt;
+            }
+            return found->second.fac->booking(found->second.index);
+        }
+
+        size_t bookingCount() const {
+            size_t count = 0;
+            for (const auto& [facilityName, fac] : facilitiesByName) {
+                count += fac->bookings.size();
+            }
+            return count;
+        }
+
+        // Columns of every facility plus the booking index, which takes most of it
+        size_t bookingMemoryBytes() const {
+            size_t bytes = bookingIndex.memoryBytes();
+            for (const auto& [facilityName, fac] : facilitiesByName) {
+                bytes += fac->bookings.memoryBytes();
+            }
+            return bytes;
+        }
+};
+
+FacilityRegistry facilities;
+
+// Rows of one facility, reread after another session changed them
+const char* RELOAD_FACILITY_SQL =
+    "SELECT booking_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute, booking_status "
+    "FROM booking WHERE facility_id = $1";
+
+// Facilities whose rows another database session has written. The
+// notification thread adds names; the listener takes them and reloads those
+// facilities, since it is the only thread that touches the schedules.
+class ExternalChanges {
+    public:
+        std::mutex mtx;
+        std::unordered_set<std::string> facilityNames;
+
+        void add(const std::string& facilityName) {
+            std::lock_guard<std::mutex> lock(mtx);
+            facilityNames.insert(facilityName);
+        }
+
+        std::vector<std::string> take() {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::vector<std::string> taken(facilityNames.begin(), facilityNames.end());
+            facilityNames.clear();
+            return taken;
+        }
+
+        bool empty() {
+            std::lock_guard<std::mutex> lock(mtx);
+            return facilityNames.empty();
+        }
+};
+
+ExternalChanges externalChanges;
+
+#endif
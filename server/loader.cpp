@@ -0,0 +1,514 @@
+#ifndef LOADER_CPP
+#define LOADER_CPP
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <libpq-fe.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "facility.cpp"
+
+const char* SNAPSHOT_PATH = "facility.snapshot";
+const char SNAPSHOT_MAGIC[8] = {'F', 'B', 'S', 'N', 'A', 'P', '0', '1'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+// Number of database connections used to stream the booking table at startup
+const int BULK_LOAD_CONNECTIONS = 4;
+
+// Cheap summary of the database contents. If it matches the one stored in a
+// snapshot, nothing has been written since the snapshot was taken.
+struct Watermark {
+    int64_t facilityCount;
+    int64_t maxFacilityId;
+    int64_t bookingCount;
+    int64_t maxBookingId;
+    int64_t maxBookingXmin;
+
+    bool operator==(const Watermark& other) const {
+        return facilityCount == other.facilityCount && maxFacilityId == other.maxFacilityId &&
+               bookingCount == other.bookingCount && maxBookingId == other.maxBookingId &&
+               maxBookingXmin == other.maxBookingXmin;
+    }
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    Watermark watermark;
+    uint64_t facilityCount;
+    uint64_t bookingCount;
+    uint64_t stringBytes;
+};
+
+struct SnapshotFacility {
+    int64_t facilityId;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+};
+
+struct SnapshotBooking {
+    int64_t bookingId;
+    int64_t facilityId;
+    uint32_t userOffset;
+    uint32_t userLength;
+    uint8_t bookingStartDay;
+    uint8_t bookingStartHour;
+    uint8_t bookingStartMinute;
+    uint8_t bookingEndDay;
+    uint8_t bookingEndHour;
+    uint8_t bookingEndMinute;
+    uint8_t bookingStatus;
+    uint8_t padding;
+};
+
+// A booking row as decoded from the binary COPY stream
+struct LoadedBooking {
+    int64_t bookingId;
+    int64_t facilityId;
+    std::string userName;
+    // Day, hour, minute of start and end, then status, as stored. They are
+    // only narrowed once addLoadedBooking has validated them; NULL reads as -1.
+    int32_t fields[7];
+};
+
+int64_t readInt64BE(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | p[i];
+    }
+    return (int64_t)value;
+}
+
+int32_t readInt32BE(const unsigned char* p) {
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+int16_t readInt16BE(const unsigned char* p) {
+    return (int16_t)(((uint16_t)p[0] << 8) | (uint16_t)p[1]);
+}
+
+// Incremental parser for COPY ... (FORMAT binary). Chunks from PQgetCopyData
+// are appended and every complete tuple is handed to onTuple as a list of
+// (pointer, length) fields; a length of -1 marks NULL.
+class CopyBinaryParser {
+    public:
+        std::string buffer;
+        size_t consumed = 0;
+        bool headerSeen = false;
+        bool finished = false;
+
+        template <typename F>
+        bool feed(const char* data, int length, F onTuple) {
+            buffer.append(data, length);
+            const unsigned char* base = (const unsigned char*)buffer.data();
+            while (!finished) {
+                size_t available = buffer.size() - consumed;
+                const unsigned char* p = base + consumed;
+                if (!headerSeen) {
+                    // 11 byte signature, 4 byte flags, 4 byte extension length
+                    if (available < 19) break;
+                    if (memcmp(p, "PGCOPY\n\377\r\n\0", 11) != 0) {
+                        std::cerr << "Invalid COPY signature" << std::endl;
+                        return false;
+                    }
+                    uint32_t extensionLength = (uint32_t)readInt32BE(p + 15);
+                    if (available < 19 + extensionLength) break;
+                    consumed += 19 + extensionLength;
+                    headerSeen = true;
+                    continue;
+                }
+                if (available < 2) break;
+                int16_t fieldCount = readInt16BE(p);
+                if (fieldCount == -1) {
+                    finished = true;
+                    consumed += 2;
+                    break;
+                }
+                std::vector<std::pair<const unsigned char*, int32_t>> fields;
+                size_t pos = 2;
+                bool complete = true;
+                for (int i = 0; i < fieldCount; i++) {
+                    if (available < pos + 4) { complete = false; break; }
+                    int32_t fieldLength = readInt32BE(p + pos);
+                    pos += 4;
+                    if (fieldLength > 0 && available < pos + fieldLength) { complete = false; break; }
+                    fields.push_back({p + pos, fieldLength});
+                    if (fieldLength > 0) pos += fieldLength;
+                }
+                if (!complete) break;
+                onTuple(fields);
+                consumed += pos;
+            }
+            // Drop parsed bytes once they make up most of the buffer
+            if (consumed > 0 && consumed * 2 >= buffer.size()) {
+                buffer.erase(0, consumed);
+                consumed = 0;
+            }
+            return true;
+        }
+};
+
+class StartupLoader {
+    public:
+        std::string connectionString = "dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432";
+
+        bool readWatermark(Watermark& watermark) {
+            PGconn* conn = PQconnectdb(connectionString.c_str());
+            if (PQstatus(conn) != CONNECTION_OK) {
+                std::cerr << "Failed to connect to database: " << PQerrorMessage(conn) << std::endl;
+                PQfinish(conn);
+                return false;
+            }
+            PGresult* res = PQexec(conn,
+                "SELECT (SELECT count(*) FROM facility), "
+                "(SELECT coalesce(max(facility_id::int8), 0) FROM facility), "
+                "(SELECT count(*) FROM booking), "
+                "(SELECT coalesce(max(booking_id::int8), 0) FROM booking), "
+                "(SELECT coalesce(max(xmin::text::int8), 0) FROM booking)");
+            bool ok = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1;
+            if (ok) {
+                watermark.facilityCount = strtoll(PQgetvalue(res, 0, 0), nullptr, 10);
+                watermark.maxFacilityId = strtoll(PQgetvalue(res, 0, 1), nullptr, 10);
+                watermark.bookingCount = strtoll(PQgetvalue(res, 0, 2), nullptr, 10);
+                watermark.maxBookingId = strtoll(PQgetvalue(res, 0, 3), nullptr, 10);
+                watermark.maxBookingXmin = strtoll(PQgetvalue(res, 0, 4), nullptr, 10);
+            } else {
+                std::cerr << "Failed to read database watermark: " << PQerrorMessage(conn) << std::endl;
+            }
+            PQclear(res);
+            PQfinish(conn);
+            return ok;
+        }
+
+        bool readBookingIdRange(int64_t& minBookingId, int64_t& maxBookingId) {
+            PGconn* conn = PQconnectdb(connectionString.c_str());
+            if (PQstatus(conn) != CONNECTION_OK) {
+                std::cerr << "Failed to connect to database: " << PQerrorMessage(conn) << std::endl;
+                PQfinish(conn);
+                return false;
+            }
+            PGresult* res = PQexec(conn, "SELECT coalesce(min(booking_id::int8), 0), coalesce(max(booking_id::int8), 0) FROM booking");
+            bool ok = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1;
+            if (ok) {
+                minBookingId = strtoll(PQgetvalue(res, 0, 0), nullptr, 10);
+                maxBookingId = strtoll(PQgetvalue(res, 0, 1), nullptr, 10);
+            } else {
+                std::cerr << "Failed to read booking ID range: " << PQerrorMessage(conn) << std::endl;
+            }
+            PQclear(res);
+            PQfinish(conn);
+            return ok;
+        }
+
+        // Runs one binary COPY and passes every tuple to onTuple
+        template <typename F>
+        bool copyOut(PGconn* conn, const std::string& query, F onTuple) {
+            PGresult* res = PQexec(conn, query.c_str());
+            if (PQresultStatus(res) != PGRES_COPY_OUT) {
+                std::cerr << "COPY failed: " << PQerrorMessage(conn) << std::endl;
+                PQclear(res);
+                return false;
+            }
+            PQclear(res);
+            CopyBinaryParser parser;
+            bool ok = true;
+            char* chunk = nullptr;
+            int length;
+            while ((length = PQgetCopyData(conn, &chunk, 0)) > 0) {
+                if (ok) {
+                    ok = parser.feed(chunk, length, onTuple);
+                }
+                PQfreemem(chunk);
+            }
+            if (length == -2) {
+                std::cerr << "COPY stream error: " << PQerrorMessage(conn) << std::endl;
+                ok = false;
+            }
+            while ((res = PQgetResult(conn)) != nullptr) {
+                if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+                    ok = false;
+                }
+                PQclear(res);
+            }
+            return ok && parser.finished;
+        }
+
+        bool bulkLoad() {
+            auto started = std::chrono::steady_clock::now();
+            std::unordered_map<int64_t, std::string> facilityNames;
+            std::vector<std::vector<LoadedBooking>> partitions(BULK_LOAD_CONNECTIONS);
+            std::vector<char> partitionOk(BULK_LOAD_CONNECTIONS, 0);
+            int64_t minBookingId, maxBookingId;
+            if (!readBookingIdRange(minBookingId, maxBookingId)) {
+                return false;
+            }
+            int64_t span = (maxBookingId - minBookingId) / BULK_LOAD_CONNECTIONS + 1;
+
+            // Each connection streams one contiguous range of booking IDs, so the
+            // primary key lets every COPY read only its own slice of the table
+            std::vector<std::thread> workers;
+            for (int part = 0; part < BULK_LOAD_CONNECTIONS; part++) {
+                int64_t rangeStart = minBookingId + part * span;
+                int64_t rangeEnd = rangeStart + span;
+                workers.emplace_back([this, part, rangeStart, rangeEnd, &partitions, &partitionOk]() {
+                    PGconn* conn = PQconnectdb(connectionString.c_str());
+                    if (PQstatus(conn) != CONNECTION_OK) {
+                        std::cerr << "Failed to connect to database: " << PQerrorMessage(conn) << std::endl;
+                        PQfinish(conn);
+                        return;
+                    }
+                    std::string query =
+                        "COPY (SELECT booking_id::int8, facility_id::int8, username::text, start_day::int4, start_hour::int4, start_minute::int4, "
+                        "end_day::int4, end_hour::int4, end_minute::int4, booking_status::int4 FROM booking WHERE booking_id >= " +
+                        std::to_string(rangeStart) + " AND booking_id < " + std::to_string(rangeEnd) + ") TO STDOUT (FORMAT binary)";
+                    std::vector<LoadedBooking>& rows = partitions[part];
+                    partitionOk[part] = copyOut(conn, query, [&rows](const std::vector<std::pair<const unsigned char*, int32_t>>& fields) {
+                        if (fields.size() != 10 || fields[0].second != 8 || fields[1].second != 8) {
+                            return;
+                        }
+                        LoadedBooking row;
+                        row.bookingId = readInt64BE(fields[0].first);
+                        row.facilityId = readInt64BE(fields[1].first);
+                        if (fields[2].second > 0) {
+                            row.userName.assign((const char*)fields[2].first, fields[2].second);
+                        }
+                        for (int i = 0; i < 7; i++) {
+                            row.fields[i] = fields[3 + i].second == 4 ? readInt32BE(fields[3 + i].first) : -1;
+                        }
+                        rows.push_back(std::move(row));
+                    });
+                    PQfinish(conn);
+                });
+            }
+
+            PGconn* conn = PQconnectdb(connectionString.c_str());
+            bool facilitiesOk = PQstatus(conn) == CONNECTION_OK && copyOut(conn,
+                "COPY (SELECT facility_id::int8, facility_name::text FROM facility) TO STDOUT (FORMAT binary)",
+                [&facilityNames](const std::vector<std::pair<const unsigned char*, int32_t>>& fields) {
+                    if (fields.size() != 2 || fields[0].second != 8 || fields[1].second < 0) {
+                        return;
+                    }
+                    facilityNames[readInt64BE(fields[0].first)] = std::string((const char*)fields[1].first, fields[1].second);
+                });
+            PQfinish(conn);
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            if (!facilitiesOk || std::count(partitionOk.begin(), partitionOk.end(), 0) > 0) {
+                std::cerr << "Bulk load failed" << std::endl;
+                return false;
+            }
+
+            std::vector<LoadedBooking> rows;
+            for (auto& partition : partitions) {
+                rows.insert(rows.end(), std::make_move_iterator(partition.begin()), std::make_move_iterator(partition.end()));
+            }
+            std::sort(rows.begin(), rows.end(), [](const LoadedBooking& a, const LoadedBooking& b) {
+                return a.bookingId < b.bookingId;
+            });
+            install(facilityNames, rows);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+            std::cout << "Bulk loaded " << facilityNames.size() << " facilities and " << rows.size() << " bookings in " << elapsed.count() << " ms" << std::endl;
+            return true;
+        }
+
+        void install(const std::unordered_map<int64_t, std::string>& facilityNames, const std::vector<LoadedBooking>& rows) {
+            std::unordered_map<int64_t, facility*> facilitiesById;
+            for (const auto& [facilityId, facilityName] : facilityNames) {
+                facilitiesById[facilityId] = &facilities.adopt(std::to_string(facilityId), facilityName);
+            }
+            for (const LoadedBooking& row : rows) {
+                auto found = facilitiesById.find(row.facilityId);
+                if (found == facilitiesById.end()) {
+                    continue;
+                }
+                found->second->addLoadedBooking((uint32_t)row.bookingId, row.userName, (uint)row.fields[0], (uint)row.fields[1], (uint)row.fields[2],
+                                                (uint)row.fields[3], (uint)row.fields[4], (uint)row.fields[5], (uint)row.fields[6]);
+            }
+        }
+
+        bool loadSnapshot(const char* path) {
+            auto started = std::chrono::steady_clock::now();
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                std::cout << "No snapshot found" << std::endl;
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+                close(fd);
+                return false;
+            }
+            size_t size = st.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) {
+                perror("Snapshot mmap failed");
+                return false;
+            }
+            const char* base = (const char*)mapped;
+            SnapshotHeader header;
+            memcpy(&header, base, sizeof(header));
+            size_t facilitiesOffset = sizeof(SnapshotHeader);
+            size_t bookingsOffset = facilitiesOffset + header.facilityCount * sizeof(SnapshotFacility);
+            size_t stringsOffset = bookingsOffset + header.bookingCount * sizeof(SnapshotBooking);
+            Watermark current;
+            bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+                         header.version == SNAPSHOT_VERSION &&
+                         header.facilityCount < size && header.bookingCount < size &&
+                         stringsOffset + header.stringBytes == size;
+            if (!valid) {
+                std::cerr << "Snapshot is corrupt or from another version" << std::endl;
+            } else if (!readWatermark(current) || !(current == header.watermark)) {
+                std::cout << "Snapshot is stale" << std::endl;
+                valid = false;
+            }
+            if (valid) {
+                const char* strings = base + stringsOffset;
+                std::unordered_map<int64_t, std::string> facilityNames;
+                for (uint64_t i = 0; i < header.facilityCount && valid; i++) {
+                    SnapshotFacility record;
+                    memcpy(&record, base + facilitiesOffset + i * sizeof(record), sizeof(record));
+                    valid = (uint64_t)record.nameOffset + record.nameLength <= header.stringBytes;
+                    if (valid) {
+                        facilityNames[record.facilityId] = std::string(strings + record.nameOffset, record.nameLength);
+                    }
+                }
+                std::vector<LoadedBooking> rows;
+                rows.reserve(header.bookingCount);
+                for (uint64_t i = 0; i < header.bookingCount && valid; i++) {
+                    SnapshotBooking record;
+                    memcpy(&record, base + bookingsOffset + i * sizeof(record), sizeof(record));
+                    valid = (uint64_t)record.userOffset + record.userLength <= header.stringBytes;
+                    if (valid) {
+                        LoadedBooking row;
+                        row.bookingId = record.bookingId;
+                        row.facilityId = record.facilityId;
+                        row.userName.assign(strings + record.userOffset, record.userLength);
+                        row.fields[0] = record.bookingStartDay;
+                        row.fields[1] = record.bookingStartHour;
+                        row.fields[2] = record.bookingStartMinute;
+                        row.fields[3] = record.bookingEndDay;
+                        row.fields[4] = record.bookingEndHour;
+                        row.fields[5] = record.bookingEndMinute;
+                        row.fields[6] = record.bookingStatus;
+                        rows.push_back(std::move(row));
+                    }
+                }
+                if (valid) {
+                    install(facilityNames, rows);
+                    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+                    std::cout << "Loaded snapshot with " << facilityNames.size() << " facilities and " << rows.size() << " bookings in " << elapsed.count() << " ms" << std::endl;
+                } else {
+                    std::cerr << "Snapshot string table is corrupt" << std::endl;
+                }
+            }
+            munmap(mapped, size);
+            return valid;
+        }
+
+        // The watermark is only a fair summary of memory if memory is in sync:
+        // a write still in flight after the drain timeout, or a change made by
+        // another session that was not applied yet, is counted by the database
+        // but missing here. inSync is asked before the watermark is read and
+        // again before the snapshot replaces the old one, so a change announced
+        // in between also discards it.
+        void writeSnapshot(const char* path, std::function<bool()> inSync) {
+            if (!inSync()) {
+                std::cerr << "Memory is not in sync with the database, skipping snapshot" << std::endl;
+                return;
+            }
+            SnapshotHeader header;
+            memset(&header, 0, sizeof(header));
+            if (!readWatermark(header.watermark)) {
+                std::cerr << "Skipping snapshot" << std::endl;
+                return;
+            }
+            memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+            header.version = SNAPSHOT_VERSION;
+
+            std::vector<SnapshotFacility> facilityRecords;
+            std::vector<SnapshotBooking> bookingRecords;
+            std::string strings;
+            std::unordered_map<uint32_t, uint32_t> userOffsets;
+            for (const auto& [facilityName, fac] : facilities.facilitiesByName) {
+                if (fac->facilityId == "") {
+                    continue;
+                }
+                SnapshotFacility facilityRecord;
+                facilityRecord.facilityId = std::stoll(fac->facilityId);
+                facilityRecord.nameOffset = (uint32_t)strings.size();
+                facilityRecord.nameLength = (uint32_t)facilityName.size();
+                strings += facilityName;
+                facilityRecords.push_back(facilityRecord);
+                const BookingStore& store = fac->bookings;
+                for (size_t i = 0; i < store.size(); i++) {
+                    if (store.ids[i] == NO_BOOKING_ID) {
+                        continue;
+                    }
+                    SnapshotBooking record;
+                    memset(&record, 0, sizeof(record));
+                    record.bookingId = store.ids[i];
+                    record.facilityId = facilityRecord.facilityId;
+                    const std::string& userName = userNames.get(store.users[i]);
+                    auto [it, inserted] = userOffsets.emplace(store.users[i], (uint32_t)strings.size());
+                    if (inserted) {
+                        strings += userName;
+                    }
+                    record.userOffset = it->second;
+                    record.userLength = (uint32_t)userName.size();
+                    record.bookingStartDay = (uint8_t)weekDay(store.starts[i]);
+                    record.bookingStartHour = (uint8_t)weekHour(store.starts[i]);
+                    record.bookingStartMinute = (uint8_t)weekMinute(store.starts[i]);
+                    record.bookingEndDay = (uint8_t)weekDay(store.ends[i]);
+                    record.bookingEndHour = (uint8_t)weekHour(store.ends[i]);
+                    record.bookingEndMinute = (uint8_t)weekMinute(store.ends[i]);
+                    record.bookingStatus = (uint8_t)store.status(i);
+                    bookingRecords.push_back(record);
+                }
+            }
+            header.facilityCount = facilityRecords.size();
+            header.bookingCount = bookingRecords.size();
+            header.stringBytes = strings.size();
+
+            // Write to a temporary file and rename so a crash never leaves a torn snapshot
+            std::string tmpPath = std::string(path) + ".tmp";
+            FILE* file = fopen(tmpPath.c_str(), "wb");
+            if (file == nullptr) {
+                perror("Failed to open snapshot");
+                return;
+            }
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            ok = ok && fwrite(facilityRecords.data(), sizeof(SnapshotFacility), facilityRecords.size(), file) == facilityRecords.size();
+            ok = ok && fwrite(bookingRecords.data(), sizeof(SnapshotBooking), bookingRecords.size(), file) == bookingRecords.size();
+            ok = ok && fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+            ok = fflush(file) == 0 && ok;
+            ok = fsync(fileno(file)) == 0 && ok;
+            fclose(file);
+            if (ok && !inSync()) {
+                std::cerr << "Database changed while writing the snapshot, skipping it" << std::endl;
+                unlink(tmpPath.c_str());
+                return;
+            }
+            if (!ok || rename(tmpPath.c_str(), path) != 0) {
+                perror("Failed to write snapshot");
+                unlink(tmpPath.c_str());
+                return;
+            }
+            std::cout << "Snapshot written with " << header.facilityCount << " facilities and " << header.bookingCount << " bookings" << std::endl;
+        }
+};
+
+StartupLoader startupLoader;
+
+#endif
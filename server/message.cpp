@@ -5,7 +5,8 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string>
-#endif
+#include <vector>
+#include <tuple>
 
 
 
@@ -33,7 +34,7 @@ class Message {
         }
 
         std::tuple<size_t, char*> createReply(std::vector<unsigned char> data, uint8_t errorCode = 0) {
-            size_t total_length = sizeof(this->msg.requestType) + sizeof(this->msg.requestID) + sizeof(this->msg.choice) + sizeof(errorCode) + (this->msg.length) + data.size();
+            size_t total_length = sizeof(this->msg.requestType) + sizeof(this->msg.requestID) + sizeof(this->msg.choice) + sizeof(errorCode) + sizeof(uint32_t) + data.size();
             char* replyBytes = new char[total_length];
             size_t offset = 0;
             unsigned char requestType = static_cast<unsigned char>(0b0);
@@ -56,3 +57,5 @@ class Message {
             // Destructor
         }
 };
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef MONITOR_CPP
+#define MONITOR_CPP
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "message.cpp"
+#include "bookings.cpp"
+#include "capture.cpp"
+
+// How subscribers want to hear about changes. Coalesced is the default; the
+// mode byte after the watch duration opts into one text callback per change.
+enum MonitorDelivery {
+    deliverCoalesced = 0,
+    deliverPerEvent = 1
+};
+
+// Changes to a facility within this long of the first one are sent together
+const std::chrono::milliseconds DEFAULT_MONITOR_WINDOW(200);
+
+struct MonitorClients {
+    int socket_fd;
+    sockaddr_in clientAddress;
+    socklen_t clientAddressLength = sizeof(clientAddress);
+    std::chrono::steady_clock::time_point expires;
+    Message msg;
+    MonitorDelivery delivery = deliverCoalesced;
+};
+
+// Changes to one facility waiting for its window to close. For each day the
+// earliest start and latest end touched, in minutes since midnight.
+struct PendingDelta {
+    std::chrono::steady_clock::time_point firstChange;
+    uint32_t changeCount = 0;
+    uint8_t dayMask = 0;
+    uint16_t dayStart[7];
+    uint16_t dayEnd[7];
+};
+
+// Fans booking notifications out to the clients monitoring each facility.
+// The notification thread calls publish() and flushDue(); the listener adds
+// subscribers, so both go through the mutex.
+class MonitorHub {
+    public:
+        std::mutex mtx;
+        std::unordered_multimap<std::string, MonitorClients> subscribers;
+        std::unordered_map<std::string, PendingDelta> pending;
+        std::unordered_map<std::string, uint32_t> sequences;
+        std::chrono::milliseconds window = DEFAULT_MONITOR_WINDOW;
+        // Set before the notification thread starts when traffic is captured
+        TrafficCapture* capture = nullptr;
+
+        void subscribe(const std::string& facilityName, MonitorClients client) {
+            std::lock_guard<std::mutex> lock(mtx);
+            subscribers.emplace(facilityName, std::move(client));
+        }
+
+        void publish(const std::string& action, const std::string& facilityName, int startDay, int startHour, int startMinute, int endDay, int endHour, int endMinute, int bookingStatus) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto range = subscribers.equal_range(facilityName);
+            if (range.first == range.second) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+
+            // Per-event subscribers keep the original behaviour: booked rows only, one text message each
+            if (bookingStatus == booked) {
+                std::string text;
+                if (action == "INSERT" || action == "UPDATE") {
+                    text = "📢 Booking " + action + " for facility " + facilityName +
+                           " from Day " + std::to_string(startDay) + " " +
+                           std::to_string(startHour) + ":" + std::to_string(startMinute) +
+                           " to Day " + std::to_string(endDay) + " " +
+                           std::to_string(endHour) + ":" + std::to_string(endMinute);
+                } else { // DELETE
+                    text = "📢 Booking " + action + " for facility " + facilityName;
+                }
+                std::vector<unsigned char> data;
+                data.push_back((unsigned char)text.size());
+                data.insert(data.end(), text.begin(), text.end());
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (it->second.delivery == deliverPerEvent && now < it->second.expires) {
+                        std::cout << "Sending notification to client" << std::endl;
+                        send(it->second, data);
+                    }
+                }
+            }
+
+            // Availability changes whenever a booked slot appears, moves, is cancelled or removed
+            if (bookingStatus != booked && bookingStatus != cancelled && action != "DELETE") {
+                return;
+            }
+            if (startDay < 0 || startDay > 6) {
+                return;
+            }
+            PendingDelta& delta = pending[facilityName];
+            if (delta.changeCount == 0) {
+                delta.firstChange = now;
+            }
+            delta.changeCount++;
+            // The payload only carries an updated row's new times, so the interval it left is
+            // unknown; the whole day is reported. When another session moved the booking to
+            // another day, the listener reports the day it left through publishDays.
+            uint16_t start = action == "UPDATE" ? 0 : (uint16_t)(startHour * 60 + startMinute);
+            uint16_t end = action == "UPDATE" || endDay != startDay ? 24 * 60 : (uint16_t)(endHour * 60 + endMinute);
+            markDay(delta, startDay, start, end);
+        }
+
+        // Whole days whose bookings another session changed, as found when the
+        // listener applied the rows to the resident schedule. This covers the
+        // day an updated booking moved away from.
+        void publishDays(const std::string& facilityName, uint8_t dayMask) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto range = subscribers.equal_range(facilityName);
+            if (range.first == range.second || dayMask == 0) {
+                return;
+            }
+            PendingDelta& delta = pending[facilityName];
+            if (delta.changeCount == 0) {
+                delta.firstChange = std::chrono::steady_clock::now();
+            }
+            delta.changeCount++;
+            for (int day = 0; day < 7; day++) {
+                if (dayMask & (1 << day)) {
+                    markDay(delta, day, 0, 24 * 60);
+                }
+            }
+        }
+
+        // Widens the delta to cover start to end (minutes since midnight) of the day
+        void markDay(PendingDelta& delta, int day, uint16_t start, uint16_t end) {
+            if (!(delta.dayMask & (1 << day))) {
+                delta.dayMask |= 1 << day;
+                delta.dayStart[day] = start;
+                delta.dayEnd[day] = end;
+            } else {
+                delta.dayStart[day] = std::min(delta.dayStart[day], start);
+                delta.dayEnd[day] = std::max(delta.dayEnd[day], end);
+            }
+        }
+
+        // Sends every delta whose window has closed, one datagram per coalescing subscriber
+        void flushDue(std::chrono::steady_clock::time_point now) {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (now - it->second.firstChange < window) {
+                    ++it;
+                    continue;
+                }
+                std::vector<unsigned char> data = encodeDelta(it->first, it->second);
+                auto range = subscribers.equal_range(it->first);
+                for (auto sub = range.first; sub != range.second; ++sub) {
+                    if (sub->second.delivery == deliverCoalesced && now < sub->second.expires) {
+                        send(sub->second, data);
+                    }
+                }
+                std::cout << "Sent delta of " << it->second.changeCount << " changes for facility " << it->first << std::endl;
+                it = pending.erase(it);
+            }
+            // Expired subscribers are dropped here rather than on every publish
+            for (auto it = subscribers.begin(); it != subscribers.end();) {
+                if (now >= it->second.expires) {
+                    std::cout << "Client expired: " << it->first << std::endl;
+                    it = subscribers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // Delta layout, all integers in network byte order:
+        //   [4 bytes sequence number per facility][4 bytes changes merged][1 byte day count]
+        //   then per changed day: [day][start hour][start minute][end hour][end minute]
+        // A gap in the sequence means a delta was lost and the client should query availability.
+        std::vector<unsigned char> encodeDelta(const std::string& facilityName, const PendingDelta& delta) {
+            std::vector<unsigned char> data;
+            uint32_t sequence = htonl(++sequences[facilityName]);
+            data.insert(data.end(), (unsigned char*)&sequence, (unsigned char*)&sequence + sizeof(sequence));
+            uint32_t changeCount = htonl(delta.changeCount);
+            data.insert(data.end(), (unsigned char*)&changeCount, (unsigned char*)&changeCount + sizeof(changeCount));
+            size_t countPosition = data.size();
+            data.push_back(0);
+            for (int day = 0; day < 7; day++) {
+                if (!(delta.dayMask & (1 << day))) {
+                    continue;
+                }
+                data.push_back((unsigned char)day);
+                data.push_back((unsigned char)(delta.dayStart[day] / 60));
+                data.push_back((unsigned char)(delta.dayStart[day] % 60));
+                data.push_back((unsigned char)(delta.dayEnd[day] / 60));
+                data.push_back((unsigned char)(delta.dayEnd[day] % 60));
+                data[countPosition]++;
+            }
+            return data;
+        }
+
+        void send(MonitorClients& client, const std::vector<unsigned char>& data) {
+            auto [total_length, replyBuffer] = client.msg.createReply(data);
+            sendto(client.socket_fd, replyBuffer, total_length, 0,
+                   (struct sockaddr *)&client.clientAddress, client.clientAddressLength);
+            if (capture != nullptr) {
+                capture->record(traceCallback, client.clientAddress, replyBuffer, total_length);
+            }
+            delete[] replyBuffer;
+        }
+};
+
+MonitorHub monitors;
+
+#endif
@@ -0,0 +1,202 @@
+#include <iostream>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+#include "capture.cpp"
+
+// Replays a trace recorded with `connection --capture <file>` against a
+// server and compares its replies with the recorded ones.
+//
+//   replay <trace> [host] [port] [speed]
+//
+// speed is a multiplier on the recorded timing (1 = real time, 10 = ten
+// times faster) or "max" to send as fast as replies come back. Requests
+// from one recorded client are sent from one socket, in order, and each
+// waits for the reply to the one before it. Monitor callbacks depend on
+// timing (deltas are coalesced per window), so they are counted per client
+// rather than compared byte for byte.
+
+const std::chrono::milliseconds REPLY_TIMEOUT(2000);
+
+struct ReplayClient {
+    int socket_fd;
+    size_t callbacksRecorded = 0;
+    size_t callbacksReceived = 0;
+    std::deque<size_t> pending;
+    bool waiting = false;
+    size_t inFlight = 0;
+    uint32_t inFlightRequestID = 0;
+    std::chrono::steady_clock::time_point sentAt;
+};
+
+uint32_t requestIdOf(const std::vector<unsigned char>& bytes) {
+    uint32_t requestID = 0;
+    if (bytes.size() >= 5) {
+        memcpy(&requestID, bytes.data() + 1, sizeof(requestID));
+    }
+    return ntohl(requestID);
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace> [host] [port] [speed|max]" << std::endl;
+        return 1;
+    }
+    std::string tracePath = argv[1];
+    std::string host = argc > 2 ? argv[2] : "127.0.0.1";
+    int port = argc > 3 ? std::stoi(argv[3]) : 8014;
+    std::string speedArg = argc > 4 ? argv[4] : "1";
+    double speed = speedArg == "max" ? 0 : std::stod(speedArg);
+
+    std::vector<TraceRecord> records;
+    if (!readTrace(tracePath, records)) {
+        return 1;
+    }
+
+    sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &serverAddress.sin_addr) != 1) {
+        std::cerr << "Invalid server address: " << host << std::endl;
+        return 1;
+    }
+
+    // Pair each recorded request with the reply the server sent for it
+    std::map<uint64_t, ReplayClient> clients;
+    std::map<std::pair<uint64_t, uint32_t>, std::deque<size_t>> unanswered;
+    std::map<size_t, size_t> expectedReply;
+    size_t requestCount = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const TraceRecord& record = records[i];
+        uint64_t clientKey = ((uint64_t)record.ip << 16) | record.port;
+        auto key = std::make_pair(clientKey, requestIdOf(record.bytes));
+        if (record.direction == traceRequest) {
+            clients[clientKey].pending.push_back(i);
+            unanswered[key].push_back(i);
+            requestCount++;
+        } else if (record.direction == traceCallback) {
+            clients[clientKey].callbacksRecorded++;
+        } else if (!unanswered[key].empty()) {
+            expectedReply[unanswered[key].front()] = i;
+            unanswered[key].pop_front();
+        }
+    }
+    std::cout << "Replaying " << requestCount << " requests from " << clients.size() << " clients at "
+              << (speed == 0 ? std::string("max") : speedArg + "x") << " speed" << std::endl;
+
+    for (auto& [clientKey, client] : clients) {
+        client.socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (client.socket_fd < 0) {
+            perror("Socket creation failed");
+            return 1;
+        }
+    }
+
+    size_t matched = 0, mismatched = 0, unrecorded = 0, busy = 0, timeouts = 0;
+    std::vector<double> latenciesUs;
+    unsigned char buffer[65536];
+    auto started = std::chrono::steady_clock::now();
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        bool active = false;
+        auto nextWake = now + std::chrono::milliseconds(100);
+        std::vector<pollfd> pfds;
+        std::vector<ReplayClient*> polled;
+        for (auto& [clientKey, client] : clients) {
+            if (client.waiting && now - client.sentAt > REPLY_TIMEOUT) {
+                timeouts++;
+                client.waiting = false;
+            }
+            if (!client.waiting && !client.pending.empty()) {
+                const TraceRecord& request = records[client.pending.front()];
+                auto due = started + std::chrono::nanoseconds(speed == 0 ? 0 : (uint64_t)(request.timestampNs / speed));
+                if (now >= due) {
+                    sendto(client.socket_fd, request.bytes.data(), request.bytes.size(), 0, (struct sockaddr *)&serverAddress, sizeof(serverAddress));
+                    client.inFlight = client.pending.front();
+                    client.inFlightRequestID = requestIdOf(request.bytes);
+                    client.sentAt = std::chrono::steady_clock::now();
+                    client.waiting = true;
+                    client.pending.pop_front();
+                } else {
+                    nextWake = std::min(nextWake, due);
+                }
+            }
+            if (client.waiting) {
+                nextWake = std::min(nextWake, client.sentAt + REPLY_TIMEOUT);
+            }
+            // Every socket is read so that callbacks are counted while the client is idle
+            pfds.push_back({client.socket_fd, POLLIN, 0});
+            polled.push_back(&client);
+            active = active || client.waiting || !client.pending.empty();
+        }
+        if (!active) {
+            break;
+        }
+        int timeoutMs = (int)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(nextWake - now).count());
+        if (poll(pfds.data(), pfds.size(), timeoutMs) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            ReplayClient& client = *polled[i];
+            int n = recv(client.socket_fd, buffer, sizeof(buffer), 0);
+            if (n < 7) {
+                continue;
+            }
+            std::vector<unsigned char> reply(buffer, buffer + n);
+            // Anything else on this socket is a monitor callback or a late reply
+            if (!client.waiting || requestIdOf(reply) != client.inFlightRequestID) {
+                client.callbacksReceived++;
+                continue;
+            }
+            auto latency = std::chrono::steady_clock::now() - client.sentAt;
+            latenciesUs.push_back(std::chrono::duration<double, std::micro>(latency).count());
+            client.waiting = false;
+            auto expected = expectedReply.find(client.inFlight);
+            if (reply[6] == 255) {
+                busy++;
+            } else if (expected == expectedReply.end()) {
+                unrecorded++;
+            } else if (records[expected->second].bytes == reply) {
+                matched++;
+            } else {
+                mismatched++;
+            }
+        }
+    }
+    double elapsedS = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    size_t callbacksRecorded = 0, callbacksReceived = 0;
+    for (auto& [clientKey, client] : clients) {
+        callbacksRecorded += client.callbacksRecorded;
+        callbacksReceived += client.callbacksReceived;
+        close(client.socket_fd);
+    }
+
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    std::cout << "Replayed " << requestCount << " requests in " << elapsedS << " s" << std::endl;
+    std::cout << "Replies: " << latenciesUs.size() << " (matched " << matched << ", mismatched " << mismatched
+              << ", busy " << busy << ", not recorded " << unrecorded << "), timeouts: " << timeouts << std::endl;
+    std::cout << "Monitor callbacks: " << callbacksReceived << " received, " << callbacksRecorded << " recorded" << std::endl;
+    std::cout << "Latency us: p50 " << percentile(latenciesUs, 0.50) << ", p90 " << percentile(latenciesUs, 0.90)
+              << ", p99 " << percentile(latenciesUs, 0.99) << ", max " << (latenciesUs.empty() ? 0 : latenciesUs.back()) << std::endl;
+    return mismatched == 0 && timeouts == 0 ? 0 : 2;
+}
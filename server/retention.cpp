@@ -0,0 +1,287 @@
+#ifndef RETENTION_CPP
+#define RETENTION_CPP
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <utility>
+#include <pqxx/pqxx>
+#include "facility.cpp"
+#include "asyncdb.cpp"
+#include "tokens.cpp"
+
+// Failed booking attempts are appended here instead of being kept in the
+// booking table or in memory. One tab separated line per attempt:
+//   unix time, facility ID, username, start day, hour, minute, end day, hour, minute, reason
+const char* AUDIT_LOG_PATH = "failed_attempts.log";
+const size_t AUDIT_BUFFER_SIZE = 1 << 16;
+
+// How often the compactor looks for work
+const std::chrono::seconds COMPACTION_INTERVAL(60);
+
+// Failed entries a facility may hold before its columns are rewritten
+const uint32_t COMPACTION_THRESHOLD = 64;
+
+const char* CREATE_ARCHIVE_SQL =
+    "CREATE TABLE IF NOT EXISTS booking_archive ("
+    "booking_id int8, facility_id int8, username text, start_day int, start_hour int, start_minute int, "
+    "end_day int, end_hour int, end_minute int, booking_status int, archive_week int NOT NULL"
+    ") PARTITION BY LIST (archive_week)";
+const char* CREATE_SCHEDULE_WEEK_SQL = "CREATE TABLE IF NOT EXISTS schedule_week (week int NOT NULL)";
+
+// Every booking row carries the schedule week it was accepted in, which is
+// what decides when it leaves the booking table
+const char* ADD_BOOKING_WEEK_SQL = "ALTER TABLE booking ADD COLUMN IF NOT EXISTS booking_week int";
+
+// Rows written by other sessions have no week; they belong to the week that is ending
+const char* TAG_BOOKING_WEEK_SQL = "UPDATE booking SET booking_week = $1::int WHERE booking_week IS NULL";
+const char* SET_SCHEDULE_WEEK_SQL = "UPDATE schedule_week SET week = $1::int";
+
+// Tokens of bookings that are archived go with them
+const char* ARCHIVE_ACCESS_SQL =
+    "DELETE FROM access WHERE booking_id IN (SELECT booking_id FROM booking WHERE booking_week < $1::int)";
+
+// Moves every booking of a week before $1 into its week's archive partition
+const char* ARCHIVE_WEEKS_SQL =
+    "WITH moved AS (DELETE FROM booking WHERE booking_week < $1::int RETURNING *) "
+    "INSERT INTO booking_archive (booking_id, facility_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute, booking_status, archive_week) "
+    "SELECT booking_id, facility_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute, booking_status, booking_week FROM moved";
+
+// How long a rollover the database refused waits before it is tried again
+const std::chrono::seconds ROLLOVER_RETRY_INTERVAL(5);
+
+enum AuditReason {
+    auditConflict = 0,
+    auditNotSaved = 1,
+    auditMigrated = 2
+};
+
+// Weeks since the Monday before the Unix epoch, in the server's local time
+// zone (TZ selects another one). The schedule's days are Monday based and
+// the clients book in local time, so a week only ends once its Sunday has
+// passed locally.
+uint32_t currentWeek() {
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    long long seconds = (long long)now + local.tm_gmtoff;
+    return (uint32_t)((seconds / 86400 + 3) / 7);
+}
+
+// Creates the archive partition of every week that still has rows in the booking table before the given one
+std::string archivePartitionsSql(uint32_t week) {
+    return "DO $$ DECLARE w int; BEGIN "
+           "FOR w IN SELECT DISTINCT booking_week FROM booking WHERE booking_week < " + std::to_string(week) + " LOOP "
+           "EXECUTE format('CREATE TABLE IF NOT EXISTS booking_archive_w%s PARTITION OF booking_archive FOR VALUES IN (%s)', w, w); "
+           "END LOOP; END $$";
+}
+
+// The statements that end the schedule week endingWeek and start week, in
+// the order they run within one transaction. Running them again is harmless.
+std::vector<std::pair<std::string, std::vector<std::string>>> rolloverStatements(uint32_t endingWeek, uint32_t week) {
+    return {
+        {TAG_BOOKING_WEEK_SQL, {std::to_string(endingWeek)}},
+        {SET_SCHEDULE_WEEK_SQL, {std::to_string(week)}},
+        {archivePartitionsSql(week), {}},
+        {ARCHIVE_ACCESS_SQL, {std::to_string(week)}},
+        {ARCHIVE_WEEKS_SQL, {std::to_string(week)}}
+    };
+}
+
+class AuditLog {
+    public:
+        FILE* file = nullptr;
+        std::vector<char> fileBuffer;
+        size_t recorded = 0;
+
+        bool open(const std::string& path) {
+            file = fopen(path.c_str(), "a");
+            if (file == nullptr) {
+                perror("Failed to open audit log");
+                return false;
+            }
+            fileBuffer.resize(AUDIT_BUFFER_SIZE);
+            setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+            return true;
+        }
+
+        void record(const std::string& facilityId, const std::string& userName, uint startDay, uint startHour, uint startMinute, uint endDay, uint endHour, uint endMinute, AuditReason reason) {
+            if (file == nullptr) {
+                return;
+            }
+            long long now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            fprintf(file, "%lld\t%s\t%s\t%u\t%u\t%u\t%u\t%u\t%u\t%d\n", now, facilityId.c_str(), userName.c_str(),
+                    startDay, startHour, startMinute, endDay, endHour, endMinute, (int)reason);
+            recorded++;
+        }
+
+        void flush() {
+            if (file != nullptr) {
+                fflush(file);
+            }
+        }
+
+        void close() {
+            if (file != nullptr) {
+                fclose(file);
+                file = nullptr;
+            }
+        }
+
+        ~AuditLog() {
+            close();
+        }
+};
+
+AuditLog auditLog;
+
+// Keeps the resident schedule and the booking table down to the live week.
+// Failed attempts never enter them; tombstones left by writes the database
+// refused are squeezed out, and when the week turns the whole schedule is
+// moved to the archive partition of the week each booking was accepted in.
+class Retention {
+    public:
+        // Week new bookings are accepted in; it only moves once the database has moved with it
+        uint32_t scheduleWeek = 0;
+        bool rolloverInFlight = false;
+        std::chrono::steady_clock::time_point lastRolloverAttempt;
+        std::chrono::steady_clock::time_point lastRun = std::chrono::steady_clock::now();
+
+        // Runs before the facilities are loaded so that neither the bulk load
+        // nor the snapshot ever sees failed or past bookings
+        void prepare() {
+            auditLog.open(AUDIT_LOG_PATH);
+            scheduleWeek = currentWeek();
+            try {
+                pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
+                if (conn.is_open()) {
+                    std::cout << "Connected to database" << std::endl;
+                } else {
+                    std::cerr << "Failed to connect to database" << std::endl;
+                    return;
+                }
+                pqxx::work txn(conn);
+                txn.exec(CREATE_ARCHIVE_SQL);
+                txn.exec(CREATE_SCHEDULE_WEEK_SQL);
+                txn.exec(ADD_BOOKING_WEEK_SQL);
+
+                // Failed rows written before the audit log existed move to it
+                pqxx::result failedRows = txn.exec(
+                    "DELETE FROM booking WHERE booking_status = $1 "
+                    "RETURNING facility_id, username, start_day, start_hour, start_minute, end_day, end_hour, end_minute",
+                    pqxx::params(std::to_string(failed))
+                );
+
+                pqxx::result weekRes = txn.exec("SELECT week FROM schedule_week");
+                if (weekRes.size() == 0) {
+                    // First start with retention: what is there belongs to this week
+                    txn.exec("INSERT INTO schedule_week (week) VALUES ($1)", pqxx::params(std::to_string(scheduleWeek)));
+                    txn.exec(TAG_BOOKING_WEEK_SQL, pqxx::params(std::to_string(scheduleWeek)));
+                } else {
+                    uint32_t storedWeek = weekRes[0][0].as<uint32_t>();
+                    if (storedWeek < scheduleWeek) {
+                        // The server was down when the week turned
+                        for (const auto& [sql, params] : rolloverStatements(storedWeek, scheduleWeek)) {
+                            pqxx::params values;
+                            for (const std::string& value : params) {
+                                values.append(value);
+                            }
+                            txn.exec(sql, values);
+                        }
+                        std::cout << "Archived the schedule of week " << storedWeek << std::endl;
+                    } else {
+                        // The clock may have gone back; never reopen a week already archived
+                        scheduleWeek = storedWeek;
+                    }
+                }
+                txn.commit();
+                // Only rows that really left the table are logged, so a failed commit never logs them twice
+                for (const auto& row : failedRows) {
+                    auditLog.record(row[0].as<std::string>(), row[1].as<std::string>(),
+                                    row[2].as<uint>(), row[3].as<uint>(), row[4].as<uint>(),
+                                    row[5].as<uint>(), row[6].as<uint>(), row[7].as<uint>(), auditMigrated);
+                }
+                if (failedRows.size() > 0) {
+                    std::cout << "Moved " << failedRows.size() << " failed bookings to the audit log" << std::endl;
+                }
+                auditLog.flush();
+                conn.close();
+            }
+            catch (const std::exception &e) {
+                std::cerr << "Error preparing retention: " << e.what() << std::endl;
+            }
+        }
+
+        // While the rollover is in flight no write is served, so nothing is
+        // accepted into the week that is being archived
+        bool holdsWrites() const {
+            return rolloverInFlight;
+        }
+
+        // Called from the listener loop, which owns the facilities. Compaction
+        // is skipped while it could move a booking that a database callback
+        // still refers to by position.
+        void tick(AsyncDatabase& db) {
+            auto now = std::chrono::steady_clock::now();
+            uint32_t week = currentWeek();
+            if (week > scheduleWeek && !rolloverInFlight && db.connected() && now - lastRolloverAttempt >= ROLLOVER_RETRY_INTERVAL) {
+                rollover(db, week);
+            }
+            if (now - lastRun < COMPACTION_INTERVAL) {
+                return;
+            }
+            lastRun = now;
+            auditLog.flush();
+
+            size_t compacted = 0;
+            for (auto& [facilityName, fac] : facilities.facilitiesByName) {
+                if (fac->tombstones >= COMPACTION_THRESHOLD && fac->pendingWrites == 0) {
+                    compacted += fac->compact();
+                }
+            }
+            if (compacted > 0) {
+                std::cout << "Compacted " << compacted << " failed bookings" << std::endl;
+            }
+        }
+
+        // Advances the stored week and archives the ending one in a single
+        // transaction. Memory is only cleared once that has committed; every
+        // write sent before it has been answered by then, as results arrive in
+        // pipeline order, and later ones are held until it completes.
+        void rollover(AsyncDatabase& db, uint32_t week) {
+            rolloverInFlight = true;
+            lastRolloverAttempt = std::chrono::steady_clock::now();
+            uint32_t endingWeek = scheduleWeek;
+            std::cout << "Week " << endingWeek << " is over, starting week " << week << std::endl;
+            for (const auto& [sql, params] : rolloverStatements(endingWeek, week)) {
+                db.send(sql, params, [](PGresult*) {});
+            }
+            db.sync([this, endingWeek, week](bool ok) {
+                rolloverInFlight = false;
+                if (!ok) {
+                    std::cerr << "Failed to archive week " << endingWeek << ", will retry" << std::endl;
+                    return;
+                }
+                for (auto& [facilityName, fac] : facilities.facilitiesByName) {
+                    fac->clearSchedule();
+                }
+                tokenIndex.clear();
+                scheduleWeek = week;
+                std::cout << "Archived the schedule of week " << endingWeek << std::endl;
+            });
+        }
+
+        // Parameters for INSERT_BOOKING_SQL: the booking's own and the week it is accepted in
+        std::vector<std::string> insertParams(const Booking& booking) const {
+            std::vector<std::string> params = booking.databaseParams();
+            params.push_back(std::to_string(scheduleWeek));
+            return params;
+        }
+};
+
+Retention retention;
+
+#endif
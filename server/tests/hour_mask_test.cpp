@@ -0,0 +1,134 @@
+// Checks that the batched hour-mask conflict test used by bulk booking gives
+// the same answers as the one-booking-at-a-time scan. Build it like the
+// server files, e.g. from server/tests:
+//   g++ -std=c++17 hour_mask_test.cpp -o hour_mask_test -lpqxx -lpq && ./hour_mask_test
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "../facility.cpp"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Every pair of hour ranges, including same-hour bookings (mask 0) and ones
+// that end on the next day (end hour before start hour)
+static void checkAllHourPairs() {
+    for (uint s1 = 0; s1 < 24; s1++) for (uint e1 = 0; e1 < 24; e1++)
+    for (uint s2 = 0; s2 < 24; s2++) for (uint e2 = 0; e2 < 24; e2++) {
+        DayHours day;
+        day.add(s1, e1);
+        if (day.conflicts(s2, e2) != hoursConflict(s2, e2, s1, e1)) {
+            printf("FAIL: %u-%u against booked %u-%u\n", s2, e2, s1, e1);
+            failures++;
+        }
+    }
+}
+
+// A booking within one hour has no mask bits. Under the hour rule it clashes
+// with bookings that cover its hour, not with others inside the same hour.
+static void checkSameHour() {
+    facility& fac = facilities.adopt("1", "same-hour");
+    fac.addBooking(0, 9, 0, 0, 9, 30, "resident");
+    std::vector<Booking> candidates = {
+        Booking("1", 0, 8, 0, 0, 10, 0, "bulk"),   // covers the resident booking's hour
+        Booking("1", 0, 9, 30, 0, 9, 45, "bulk"),  // same hour, as is_conflicting allows
+        Booking("1", 1, 9, 0, 1, 9, 30, "bulk"),
+        Booking("1", 1, 8, 0, 1, 10, 0, "bulk")    // covers the previous candidate's hour
+    };
+    std::vector<size_t> accepted;
+    std::vector<uint8_t> outcomes = fac.addBookings(candidates, false, accepted);
+    check(outcomes[0] == slotConflict, "covering slot conflicts with a same-hour resident booking");
+    check(outcomes[1] == slotBooked, "same-hour slots follow the hour rule");
+    check(outcomes[2] == slotBooked, "free same-hour slot is booked");
+    check(outcomes[3] == slotConflictInBatch, "covering slot conflicts with a same-hour slot of the batch");
+}
+
+// Random schedules with same-hour and cross-day bookings and refused
+// entries, compared with conflictsWithBooked plus a scan of the batch
+static void checkRandomSchedules() {
+    std::mt19937 rng(2705);
+    for (int round = 0; round < 2000; round++) {
+        std::string id = std::to_string(100 + round);
+        facility& fac = facilities.adopt(id, "random-" + id);
+        auto randomSlot = [&rng, &id](const std::string& user) {
+            uint day = rng() % 7;
+            uint startHour = rng() % 24;
+            uint kind = rng() % 4;
+            uint endDay = day, endHour;
+            if (kind == 0) {
+                endHour = startHour;                                   // within one hour
+            } else if (kind == 1 && day < 6) {
+                endDay = day + 1;                                      // past midnight
+                endHour = rng() % 24;
+            } else {
+                endHour = startHour + 1 + rng() % (24 - startHour);
+                if (endHour == 24) {
+                    endHour = 23;
+                }
+            }
+            return Booking(id, day, startHour, 0, endDay, endHour, kind == 0 ? 30 : 0, user);
+        };
+        int residents = rng() % 12;
+        for (int i = 0; i < residents; i++) {
+            Booking b = randomSlot("resident");
+            auto [conflict, index] = fac.addBooking(b.bookingStartDay, b.bookingStartHour, b.bookingStartMinute,
+                                                    b.bookingEndDay, b.bookingEndHour, b.bookingEndMinute, b.userName);
+            if (conflict == 0 && rng() % 5 == 0) {
+                fac.rejectBooking(index);
+            }
+        }
+
+        std::vector<Booking> candidates;
+        int count = 1 + rng() % 16;
+        for (int i = 0; i < count; i++) {
+            candidates.push_back(randomSlot("bulk"));
+        }
+        std::vector<uint8_t> expected;
+        std::vector<const Booking*> batch;
+        for (const Booking& candidate : candidates) {
+            uint day = candidate.bookingStartDay;
+            if (fac.conflictsWithBooked(day, candidate.bookingStartHour, candidate.bookingEndHour)) {
+                expected.push_back(slotConflict);
+                continue;
+            }
+            bool inBatch = false;
+            for (const Booking* other : batch) {
+                if (other->bookingStartDay == day &&
+                    hoursConflict(candidate.bookingStartHour, candidate.bookingEndHour, other->bookingStartHour, other->bookingEndHour)) {
+                    inBatch = true;
+                }
+            }
+            if (inBatch) {
+                expected.push_back(slotConflictInBatch);
+            } else {
+                expected.push_back(slotBooked);
+                batch.push_back(&candidate);
+            }
+        }
+
+        std::vector<size_t> accepted;
+        std::vector<uint8_t> outcomes = fac.addBookings(candidates, false, accepted);
+        if (outcomes != expected) {
+            printf("FAIL: random schedule %d disagrees with the scalar scan\n", round);
+            failures++;
+        }
+    }
+}
+
+int main() {
+    checkAllHourPairs();
+    checkSameHour();
+    checkRandomSchedules();
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All hour mask checks passed\n");
+    return 0;
+}
@@ -0,0 +1,297 @@
+#ifndef TOKENS_CPP
+#define TOKENS_CPP
+#include <iostream>
+#include <cstring>
+#include <pqxx/pqxx>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
+#include "bookings.cpp"
+
+// Access tokens stay valid for one weekly booking cycle after they are issued
+const std::chrono::hours TOKEN_LIFETIME(24 * 7);
+const std::string TOKEN_LIFETIME_SECONDS = std::to_string(std::chrono::seconds(TOKEN_LIFETIME).count());
+
+// Issue times are kept in the database so expiry survives a restart
+const char* ADD_ACCESS_ISSUED_SQL = "ALTER TABLE access ADD COLUMN IF NOT EXISTS issued_at timestamptz NOT NULL DEFAULT now()";
+const char* DELETE_EXPIRED_ACCESS_SQL = "DELETE FROM access WHERE issued_at <= now() - make_interval(secs => $1::int8)";
+
+// Frees a reused code and the booking's own expired code before a new one is inserted
+const char* DELETE_REPLACED_ACCESS_SQL =
+    "DELETE FROM access WHERE (access_code = $1 OR booking_id = $2) AND issued_at <= now() - make_interval(secs => $3::int8)";
+
+// Number of codes drawn from the random device in one go
+const size_t TOKEN_BATCH_SIZE = 64;
+
+// Largest multiple of 1000000 that fits in 32 bits, used to reject biased draws
+const uint32_t TOKEN_DRAW_LIMIT = 4294000000u;
+
+struct AccessToken {
+    std::string bookingID;
+    std::string facilityName;
+    std::string userName;
+    uint bookingStartDay;
+    uint bookingStartHour;
+    uint bookingStartMinute;
+    uint bookingEndDay;
+    uint bookingEndHour;
+    uint bookingEndMinute;
+    std::chrono::system_clock::time_point expires;
+};
+
+class CodeGenerator {
+    public:
+        // std::random_device is the OS CSPRNG; it is opened once per thread
+        // and codes are drawn from it in batches instead of one per request
+        std::random_device rd;
+        std::vector<uint32_t> batch;
+        size_t next = 0;
+
+        uint32_t nextCode() {
+            if (next == batch.size()) {
+                refill();
+            }
+            return batch[next++];
+        }
+
+        void refill() {
+            batch.clear();
+            while (batch.size() < TOKEN_BATCH_SIZE) {
+                uint32_t value = rd();
+                if (value >= TOKEN_DRAW_LIMIT) {
+                    continue;
+                }
+                batch.push_back(value % 1000000);
+            }
+            next = 0;
+        }
+};
+
+thread_local CodeGenerator codeGenerator;
+
+std::string formatCode(uint32_t code) {
+    // Pad with leading zeros to make it 6 digits
+    char buffer[7]; // 6 digits + null terminator
+    snprintf(buffer, sizeof(buffer), "%06u", code);
+    return std::string(buffer);
+}
+
+// Returns false if the string is not a 6 digit code
+bool parseCode(const std::string& codeStr, uint32_t& code) {
+    if (codeStr.size() != 6) {
+        return false;
+    }
+    code = 0;
+    for (char c : codeStr) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        code = code * 10 + (c - '0');
+    }
+    return true;
+}
+
+enum TokenVerifyStatus {
+    tokenValid = 0,
+    tokenUnknown = 1,
+    tokenExpired = 2,
+    tokenWrongFacility = 3
+};
+
+class TokenIndex {
+    public:
+        std::shared_mutex mtx;
+        std::unordered_map<uint32_t, AccessToken> tokensByCode;
+        std::unordered_map<std::string, uint32_t> codesByBooking;
+        // Codes handed out whose insert has not been answered yet
+        std::unordered_set<uint32_t> reservedCodes;
+
+        void load() {
+            // Load every issued token so verification never has to hit the database
+            try {
+                pqxx::connection conn("dbname=facilitydb user=parmatmasingh password=aishi2705 host=localhost port=5432");
+                if (conn.is_open()) {
+                    std::cout << "Connected to database" << std::endl;
+                } else {
+                    std::cerr << "Failed to connect to database" << std::endl;
+                    return;
+                }
+                pqxx::work txn(conn);
+                txn.exec(ADD_ACCESS_ISSUED_SQL);
+                pqxx::result expired = txn.exec(DELETE_EXPIRED_ACCESS_SQL, pqxx::params(TOKEN_LIFETIME_SECONDS));
+                // Oldest first, so if a code was ever held twice the newer holder wins
+                pqxx::result res = txn.exec(
+                    "SELECT a.access_code, b.booking_id, f.facility_name, b.username, b.start_day, b.start_hour, b.start_minute, b.end_day, b.end_hour, b.end_minute, "
+                    "extract(epoch FROM a.issued_at)::int8 "
+                    "FROM access a, booking b, facility f WHERE a.booking_id = b.booking_id AND b.facility_id = f.facility_id "
+                    "AND b.booking_status = " + std::to_string(booked) + " "
+                    "ORDER BY a.issued_at;"
+                );
+                txn.commit();
+                if (expired.affected_rows() > 0) {
+                    std::cout << "Removed " << expired.affected_rows() << " expired access tokens" << std::endl;
+                }
+                std::unique_lock<std::shared_mutex> lock(mtx);
+                for (const auto& row : res) {
+                    uint32_t code;
+                    if (!parseCode(row[0].as<std::string>(), code)) {
+                        continue;
+                    }
+                    AccessToken token;
+                    token.bookingID = row[1].as<std::string>();
+                    token.facilityName = row[2].as<std::string>();
+                    token.userName = row[3].as<std::string>();
+                    token.bookingStartDay = static_cast<uint>(row[4].as<int>());
+                    token.bookingStartHour = static_cast<uint>(row[5].as<int>());
+                    token.bookingStartMinute = static_cast<uint>(row[6].as<int>());
+                    token.bookingEndDay = static_cast<uint>(row[7].as<int>());
+                    token.bookingEndHour = static_cast<uint>(row[8].as<int>());
+                    token.bookingEndMinute = static_cast<uint>(row[9].as<int>());
+                    token.expires = std::chrono::system_clock::from_time_t(row[10].as<int64_t>()) + TOKEN_LIFETIME;
+                    store(code, std::move(token));
+                }
+                std::cout << "Loaded " << tokensByCode.size() << " access tokens" << std::endl;
+                conn.close();
+            }
+            catch (const std::exception &e) {
+                std::cerr << "Error loading access tokens: " << e.what() << std::endl;
+            }
+        }
+
+        // Only live tokens are found; a booking whose token expired can be issued a new one
+        bool findByBooking(const std::string& bookingID, AccessToken& token) {
+            std::shared_lock<std::shared_mutex> lock(mtx);
+            auto found = codesByBooking.find(bookingID);
+            if (found == codesByBooking.end()) {
+                return false;
+            }
+            auto holder = tokensByCode.find(found->second);
+            if (holder == tokensByCode.end() || holder->second.expires <= std::chrono::system_clock::now()) {
+                return false;
+            }
+            token = holder->second;
+            return true;
+        }
+
+        // Draws codes until one is not held by a live token or reserved by an
+        // insert in flight. Expired holders are evicted so their code can be
+        // reused. The code stays reserved until insert() or release().
+        bool generateUniqueCode(uint32_t& code, int maxAttempts = 32) {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            auto now = std::chrono::system_clock::now();
+            for (int attempt = 0; attempt < maxAttempts; attempt++) {
+                code = codeGenerator.nextCode();
+                if (reservedCodes.count(code)) {
+                    std::cout << "Access code collision, retrying" << std::endl;
+                    continue;
+                }
+                auto found = tokensByCode.find(code);
+                if (found == tokensByCode.end()) {
+                    reservedCodes.insert(code);
+                    return true;
+                }
+                if (found->second.expires <= now) {
+                    codesByBooking.erase(found->second.bookingID);
+                    tokensByCode.erase(found);
+                    reservedCodes.insert(code);
+                    return true;
+                }
+                std::cout << "Access code collision, retrying" << std::endl;
+            }
+            return false;
+        }
+
+        void insert(uint32_t code, AccessToken token) {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            reservedCodes.erase(code);
+            store(code, std::move(token));
+        }
+
+        // Replaces whatever held the code and whatever code the booking held. Caller holds the lock.
+        void store(uint32_t code, AccessToken token) {
+            auto previousHolder = tokensByCode.find(code);
+            if (previousHolder != tokensByCode.end() && previousHolder->second.bookingID != token.bookingID) {
+                codesByBooking.erase(previousHolder->second.bookingID);
+            }
+            auto previousCode = codesByBooking.find(token.bookingID);
+            if (previousCode != codesByBooking.end() && previousCode->second != code) {
+                tokensByCode.erase(previousCode->second);
+            }
+            codesByBooking[token.bookingID] = code;
+            tokensByCode[code] = std::move(token);
+        }
+
+        // Keeps the times reported at the door in step with a booking that was moved
+        void updateBooking(const Booking& booking) {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            auto found = codesByBooking.find(booking.bookingID);
+            if (found == codesByBooking.end()) {
+                return;
+            }
+            auto holder = tokensByCode.find(found->second);
+            if (holder == tokensByCode.end()) {
+                return;
+            }
+            AccessToken& token = holder->second;
+            token.bookingStartDay = booking.bookingStartDay;
+            token.bookingStartHour = booking.bookingStartHour;
+            token.bookingStartMinute = booking.bookingStartMinute;
+            token.bookingEndDay = booking.bookingEndDay;
+            token.bookingEndHour = booking.bookingEndHour;
+            token.bookingEndMinute = booking.bookingEndMinute;
+        }
+
+        // The booking was deleted or cancelled outside this server; its code no longer opens the door
+        void removeBooking(const std::string& bookingID) {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            auto found = codesByBooking.find(bookingID);
+            if (found == codesByBooking.end()) {
+                return;
+            }
+            tokensByCode.erase(found->second);
+            codesByBooking.erase(found);
+        }
+
+        // Drops every token when the bookings they open are archived. Reserved
+        // codes stay with the inserts that hold them.
+        void clear() {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            tokensByCode.clear();
+            codesByBooking.clear();
+        }
+
+        // The insert for a reserved code failed or was not needed
+        void release(uint32_t code) {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            reservedCodes.erase(code);
+        }
+
+        TokenVerifyStatus verify(const std::string& codeStr, const std::string& facilityName, AccessToken& token) {
+            uint32_t code;
+            if (!parseCode(codeStr, code)) {
+                return tokenUnknown;
+            }
+            std::shared_lock<std::shared_mutex> lock(mtx);
+            auto found = tokensByCode.find(code);
+            if (found == tokensByCode.end()) {
+                return tokenUnknown;
+            }
+            token = found->second;
+            if (token.expires <= std::chrono::system_clock::now()) {
+                return tokenExpired;
+            }
+            if (!facilityName.empty() && facilityName != token.facilityName) {
+                return tokenWrongFacility;
+            }
+            return tokenValid;
+        }
+};
+
+TokenIndex tokenIndex;
+
+#endif